@@ -0,0 +1,70 @@
+#ifndef CHECKPOINT_H_
+#define CHECKPOINT_H_
+
+#include <deque>
+#include <queue>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "simulator.h"
+
+/* Helpers for protocol_checkpoint(). Each one writes its argument while */
+/* a checkpoint is being saved and reads it back while one is restored,  */
+/* so a protocol lists its state once for both directions. Only plain    */
+/* structs (pkt, msg, windowItem, ...) may be stored this way.           */
+
+template <typename T>
+void ckpt_value(T &v) {
+  checkpoint_io(&v, sizeof(T));
+}
+
+template <typename T>
+void ckpt_array(T *v, int count) {
+  checkpoint_io(v, count * sizeof(T));
+}
+
+template <typename T>
+void ckpt_vector(std::vector<T> &v) {
+  int n = v.size();
+  ckpt_value(n);
+  v.resize(n);
+  if (n > 0)
+    ckpt_array(&v[0], n);
+}
+
+template <typename T>
+void ckpt_deque(std::deque<T> &d) {
+  int n = d.size();
+  ckpt_value(n);
+  if (!checkpoint_saving())
+    d.resize(n);
+  for (int i = 0; i < n; i++)
+    ckpt_value(d[i]);
+}
+
+template <typename T>
+void ckpt_queue(std::queue<T> &q) {
+  std::deque<T> items;
+  if (checkpoint_saving())
+    for (std::queue<T> copy = q; !copy.empty(); copy.pop())
+      items.push_back(copy.front());
+  ckpt_deque(items);
+  if (!checkpoint_saving())
+    q = std::queue<T>(items);
+}
+
+/* Guard against resuming one protocol from another's checkpoint */
+inline void ckpt_tag(const char *name) {
+  char tag[8];
+  memset(tag, 0, sizeof(tag));
+  strncpy(tag, name, sizeof(tag) - 1);
+  ckpt_array(tag, sizeof(tag));
+  if (strncmp(tag, name, sizeof(tag)) != 0) {
+    fprintf(stderr, "Checkpoint was written by %s, not %s\n", tag, name);
+    exit(-1);
+  }
+}
+
+#endif
@@ -0,0 +1,121 @@
+#ifndef CORO_H_
+#define CORO_H_
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+
+#include "simulator.h"
+#include "ring_buffer.h"
+
+/* Protocols written as coroutines. A protocol defines A_main() and     */
+/* B_main(), each the whole life of one flow's A or B endpoint, and     */
+/* links with coro.o, which implements the simulator entry points by    */
+/* queueing what arrives for the endpoint and resuming its frame when   */
+/* it is waiting for that. An endpoint waits with                       */
+/*   co_await app_message()   next message from layer 5 (A only)        */
+/*   co_await next_packet()   next packet from layer 3                  */
+/*   co_await next_packet(t)  the same, or std::nullopt if t time units */
+/*                            pass first                                */
+/*   co_await timeout(t)      t time units; packets arriving meanwhile  */
+/*                            are kept for next_packet()                */
+/* and otherwise calls the simulator API (tolayer3, tolayer5, ...) as   */
+/* the callback protocols do. An endpoint's frame is created the first  */
+/* time something happens to its flow, so idle flows cost nothing, and  */
+/* its locals are all the state it has; frames are not checkpointed.    */
+
+namespace coro {
+
+struct endpoint {
+  struct promise_type {
+    endpoint get_return_object() { return {}; }
+    std::suspend_never initial_suspend() { return {}; }
+    std::suspend_always final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+};
+
+enum wait_kind { RUNNING, MESSAGE, PACKET, PACKET_OR_TIMER, TIMER };
+
+/* one flow's A or B, between the simulator and its frame */
+struct endpoint_state {
+  int entity;
+  bool started;
+  wait_kind waiting;
+  std::coroutine_handle<> frame;
+  ring_buffer<struct msg> messages;   /* from layer 5, not yet taken */
+  ring_buffer<struct pkt> packets;    /* from layer 3, not yet taken */
+};
+
+/* the endpoint whose frame is running */
+extern thread_local endpoint_state *running;
+
+void A_backpressure(endpoint_state *ep);
+
+struct message_awaiter {
+  endpoint_state *ep = running;
+  bool await_ready() { return !ep->messages.empty(); }
+  void await_suspend(std::coroutine_handle<> h) { ep->frame = h; ep->waiting = MESSAGE; }
+  struct msg await_resume() {
+    struct msg m = ep->messages.front();
+    ep->messages.pop();
+    A_backpressure(ep);
+    return m;
+  }
+};
+
+struct packet_awaiter {
+  endpoint_state *ep = running;
+  bool await_ready() { return !ep->packets.empty(); }
+  void await_suspend(std::coroutine_handle<> h) { ep->frame = h; ep->waiting = PACKET; }
+  struct pkt await_resume() {
+    struct pkt p = ep->packets.front();
+    ep->packets.pop();
+    return p;
+  }
+};
+
+/* the entity's timer runs only while the frame is suspended here */
+struct packet_or_timer_awaiter {
+  double t;
+  endpoint_state *ep = running;
+  bool await_ready() { return !ep->packets.empty(); }
+  void await_suspend(std::coroutine_handle<> h) {
+    ep->frame = h;
+    ep->waiting = PACKET_OR_TIMER;
+    starttimer(ep->entity, t);
+  }
+  std::optional<struct pkt> await_resume() {
+    if (ep->packets.empty())
+      return std::nullopt;
+    struct pkt p = ep->packets.front();
+    ep->packets.pop();
+    return p;
+  }
+};
+
+struct timer_awaiter {
+  double t;
+  endpoint_state *ep = running;
+  bool await_ready() { return false; }
+  void await_suspend(std::coroutine_handle<> h) {
+    ep->frame = h;
+    ep->waiting = TIMER;
+    starttimer(ep->entity, t);
+  }
+  void await_resume() {}
+};
+
+inline message_awaiter app_message() { return {}; }
+inline packet_awaiter next_packet() { return {}; }
+inline packet_or_timer_awaiter next_packet(double t) { return {t}; }
+inline timer_awaiter timeout(double t) { return {t}; }
+
+}
+
+/* defined by the protocol */
+coro::endpoint A_main();
+coro::endpoint B_main();
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef FRONTEND_H_
+#define FRONTEND_H_
+
+#include "simulator.h"
+
+/* What the simulator, the UDP backend and the shared memory backend have */
+/* in common: the options they all take, the accessors of the simulator  */
+/* API that only return an option, the check of what B delivers and the  */
+/* bookkeeping behind layer5_backpressure(). Each backend's main() runs  */
+/* getopt() over COMMON_OPTIONS followed by its own, handing every option */
+/* to read_common_option() first.                                        */
+
+#define COMMON_OPTIONS "s:w:m:l:c:t:v:b:d:ne:H:q:p:f:"
+
+/* Sender buffer back-pressure, see -p */
+#define  BP_BLOCK        0   /* hold arrivals until A has room */
+#define  BP_DROP         1   /* discard messages arriving while A is full */
+#define  BP_DEFER        2   /* retry the arrival one mean interarrival later */
+
+extern int TRACE;          /* -v */
+extern int seed;           /* -s */
+extern int nsimmax;        /* -m, number of msgs to generate, then stop */
+extern float lossprob;     /* -l, probability that a packet is dropped */
+extern float corruptprob;  /* -c, probability that one bit is packet is flipped */
+extern float lambda;       /* -t, arrival rate of messages from layer 5 */
+extern int win_size;       /* -w */
+extern int rcv_bufsize;    /* -b, receiver buffer in packets, 0 = window size */
+extern float drain_rate;   /* -d, layer5 consume rate at B, 0 = immediate */
+extern int naks;           /* -n, B sends NAKs (GBN and SR) */
+extern int fec_data;       /* -e, SR FEC data packets per block, 0 = off */
+extern int fec_parity;     /* -e, SR FEC parity packets per block */
+extern int channels;       /* -H, ABT stop-and-wait channels run in parallel */
+extern int sndbuf_size;    /* -q, capacity of A's send buffer in packets */
+extern int bp_policy;      /* -p, what layer5 does when A's buffer is full */
+extern int nflows;         /* -f, sender/receiver pairs */
+
+int isNumber(char *input);
+int read_arg_int(char c);
+float read_arg_float(char c);
+
+/* 1 if an option in required was not among those seen, seen being indexed by option */
+int missing_args(const char *seen, const char *required);
+
+/* read optarg for opt if it is one of COMMON_OPTIONS; returns 0 if it is not */
+int read_common_option(int opt);
+
+/* the common options, then the backend's own lines from more */
+void display_usage(char *filename, const char *more);
+
+/* exit if datasent is not the 20 characters at expected, which is NULL */
+/* when A has no message outstanding                                    */
+void check_delivery(const char *expected, const char *datasent);
+
+/* A's send buffer as layer5 sees it, kept per flow. Times are in time */
+/* units, the backend's get_sim_time().                                */
+struct backpressure {
+  int A_full;               /* A has signalled its buffer is full */
+  int arrival_blocked;      /* an arrival is waiting for A to make room */
+  double full_since;        /* time A's buffer last filled up */
+  double stall_time;        /* total time A's buffer was full */
+};
+
+/* A's buffer filled up (full = 1) or has room again at time now; */
+/* returns 1 if an arrival held back by -p block should resume    */
+int sender_backpressure(struct backpressure *bp, int full, double now);
+
+/* total time A's buffer has been full by time now */
+double sender_stall(const struct backpressure *bp, double now);
+
+#endif
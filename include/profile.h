@@ -0,0 +1,60 @@
+#ifndef PROFILE_H_
+#define PROFILE_H_
+
+/* Hot path profiling, built in with make PROFILE=1 (-DPROFILE). Each     */
+/* PROFILE_SCOPE("name") counts the calls to the block it opens and the   */
+/* cycles (rdtsc, or steady_clock nanoseconds elsewhere) spent until the  */
+/* block is left, nested hooks included. profile.o also counts malloc,    */
+/* calloc, realloc and free, and prints a breakdown per hook to stderr     */
+/* when the program exits. Without PROFILE the macro is empty.            */
+
+#ifdef PROFILE
+
+#include <atomic>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define PROFILE_UNIT "cycles"
+static inline unsigned long long profile_now() { return __rdtsc(); }
+#else
+#include <chrono>
+#define PROFILE_UNIT "ns"
+static inline unsigned long long profile_now() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+#endif
+
+/* one instrumented block; registers itself for the report */
+struct profile_hook {
+  const char *name;
+  std::atomic<unsigned long long> calls, ticks;
+  profile_hook *next;
+
+  explicit profile_hook(const char *n);
+};
+
+struct profile_scope {
+  profile_hook *hook;
+  unsigned long long start;
+
+  explicit profile_scope(profile_hook *h) : hook(h), start(profile_now()) {}
+  ~profile_scope() {
+    hook->ticks.fetch_add(profile_now() - start, std::memory_order_relaxed);
+    hook->calls.fetch_add(1, std::memory_order_relaxed);
+  }
+};
+
+#define PROFILE_CAT2(a, b) a##b
+#define PROFILE_CAT(a, b) PROFILE_CAT2(a, b)
+#define PROFILE_SCOPE(name) \
+  static profile_hook PROFILE_CAT(profile_hook_, __LINE__)(name); \
+  profile_scope PROFILE_CAT(profile_scope_, __LINE__)(&PROFILE_CAT(profile_hook_, __LINE__))
+
+#else
+
+#define PROFILE_SCOPE(name)
+
+#endif
+
+#endif
@@ -0,0 +1,163 @@
+#ifndef RELIABLE_H_
+#define RELIABLE_H_
+
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <map>
+#include <queue>
+#include <span>
+#include <vector>
+
+#include "simulator.h"
+
+/* libreliable: ABT, GBN and SR as an embeddable byte stream. A         */
+/* connection carries bytes from its A side to its B side over a        */
+/* backend, which stands in for layer 3 and the clock. The protocols    */
+/* are the same code the simulator runs; each connection is one of      */
+/* their flows. Bytes are cut into segments of up to segment_bytes,     */
+/* each carried in one 20 byte payload whose first byte is its length.  */
+/* The protocols keep their state in globals, so all connections using  */
+/* one protocol must be driven from one thread, and connections must    */
+/* not be created or destroyed from inside a callback. The library      */
+/* provides the simulator API the protocols call, so it is linked       */
+/* instead of simulator.o, not next to it.                              */
+
+namespace reliable {
+
+enum class protocol { abt, gbn, sr };
+
+constexpr size_t segment_bytes = sizeof(msg::data) - 1;
+
+struct options {
+  int window = 10;          /* GBN and SR window in packets */
+  int sndbuf = 1000;        /* A's send buffer in packets */
+  int rcvbuf = 0;           /* SR receive buffer in packets, 0 = window */
+  float drain_rate = 0;     /* SR layer5 consume rate at B, 0 = immediate */
+  int naks = 0;             /* GBN and SR receivers NAK lost and corrupt packets */
+  int fec_data = 0;         /* SR FEC data packets per block, 0 = off */
+  int fec_parity = 1;       /* SR FEC XOR parity packets per block */
+  int channels = 1;         /* ABT stop-and-wait channels run in parallel */
+};
+
+class connection;
+
+/* Layer 3 and the clock. A backend hands every packet it delivers to */
+/* connection::arrived() and every timer that goes off to            */
+/* connection::expired(), at the time now() says it happened. Entity */
+/* 0 is A and 1 is B, as in the simulator.                           */
+class backend {
+public:
+  virtual ~backend() {}
+  virtual double now() = 0;
+  virtual void send(connection &c, int from, const struct pkt &packet) = 0;
+  virtual void start_timer(connection &c, int entity, double increment) = 0;
+  virtual void stop_timer(connection &c, int entity) = 0;
+  virtual void attach(connection &c) {}
+  virtual void detach(connection &c) {}
+};
+
+/* A protocol's entry points, from its namespace in reliable_<name>.cpp */
+struct protocol_ops {
+  void (*open)(int slot);   /* (re)initialise A and B of one flow */
+  void (*A_output)(struct msg message);
+  void (*A_input)(struct pkt packet);
+  void (*A_timerinterrupt)();
+  void (*B_input)(struct pkt packet);
+  void (*B_timerinterrupt)();
+};
+
+extern const protocol_ops abt_ops, gbn_ops, sr_ops;
+
+class connection {
+public:
+  connection(protocol proto, backend &be, const options &opts = options());
+  ~connection();
+  connection(const connection &) = delete;
+  connection &operator=(const connection &) = delete;
+
+  /* queue bytes at A; they go to the protocol as A's buffer has room */
+  void send(std::span<const std::byte> data);
+  /* called at B with every segment, in order */
+  void on_recv(std::function<void(std::span<const std::byte>)> cb) { recv_cb = cb; }
+
+  size_t backlog() const { return waiting.size(); }   /* segments not yet taken by A */
+  long long bytes_sent() const { return sent; }        /* taken by A */
+  long long bytes_delivered() const { return delivered; }
+  long id() const { return conn_id; }
+
+  /* for backends */
+  void arrived(int entity, const struct pkt &packet);
+  void expired(int entity);
+
+  /* for the layer 3/5 glue in reliable.cpp, which the protocols call */
+  /* with this connection current                                     */
+  backend &be;
+  const options opts;
+  const protocol proto;
+  int slot;                 /* the protocol's flow this connection is */
+  int A_full;               /* A has signalled its buffer is full */
+  void deliver(const char *data);
+
+private:
+  void feed();
+
+  const protocol_ops *ops;
+  long conn_id;
+  std::deque<struct msg> waiting;
+  std::function<void(std::span<const std::byte>)> recv_cb;
+  long long sent = 0, delivered = 0;
+};
+
+/* In-process backend with the simulator's channel: each packet is lost */
+/* or corrupted with the given probabilities and arrives 1 to 10 time   */
+/* units after the last packet already travelling the same way, over    */
+/* all connections attached to it. Time only moves in step() and run(). */
+class sim_backend : public backend {
+public:
+  sim_backend(unsigned long long seed = 1, float loss = 0, float corrupt = 0)
+    : stream(seed), lossprob(loss), corruptprob(corrupt) {}
+
+  double now() override { return clock; }
+  void send(connection &c, int from, const struct pkt &packet) override;
+  void start_timer(connection &c, int entity, double increment) override;
+  void stop_timer(connection &c, int entity) override;
+  void attach(connection &c) override { live[c.id()] = &c; }
+  void detach(connection &c) override;
+
+  bool step();              /* handle the next event; false once there are none */
+  void run() { while (step()) ; }
+  void run_until(double t) { while (!events.empty() && events.top().time <= t && step()) ; }
+
+  int lost = 0, corrupted = 0, packets = 0;
+
+private:
+  struct event {
+    double time;
+    long seq;               /* ties go to the earlier event */
+    long conn;
+    int entity;             /* where it happens */
+    int timer;              /* 0 = packet arrival, else the timer's generation */
+    struct pkt packet;
+  };
+  struct later {
+    bool operator()(const event &a, const event &b) const {
+      return a.time != b.time ? a.time > b.time : a.seq > b.seq;
+    }
+  };
+  float random();
+
+  std::priority_queue<event, std::vector<event>, later> events;
+  std::map<long, connection *> live;
+  std::map<std::pair<long, int>, int> timers;   /* running timer's generation, 0 = stopped */
+  double clock = 0;
+  double last_arrival[2] = {0, 0};
+  long seq = 0;
+  int generation = 0;
+  unsigned long long stream;
+  float lossprob, corruptprob;
+};
+
+}
+
+#endif
@@ -0,0 +1,79 @@
+#ifndef RING_BUFFER_H_
+#define RING_BUFFER_H_
+
+#include <vector>
+
+#include "checkpoint.h"
+
+/* Bounded FIFO. Storage starts small and doubles as items arrive, up  */
+/* to the capacity given to init(), so many mostly empty buffers stay */
+/* cheap; push() refuses items once the buffer is full.               */
+template <typename T>
+class ring_buffer {
+public:
+  ring_buffer() : limit(1), head(0), count(0) {}
+
+  void init(int capacity) {
+    limit = capacity > 0 ? capacity : 1;
+    slots.assign(limit < 16 ? limit : 16, T());
+    head = 0;
+    count = 0;
+  }
+
+  bool push(const T &item) {
+    if (full())
+      return false;
+    if (count == (int)slots.size())
+      grow();
+    slots[(head + count) % slots.size()] = item;
+    count++;
+    return true;
+  }
+
+  T &front() { return slots[head]; }
+
+  void pop() {
+    head = (head + 1) % slots.size();
+    count--;
+  }
+
+  /* Save or restore the held items, see checkpoint.h */
+  void checkpoint() {
+    int cap = capacity();
+    int n = count;
+    ckpt_value(cap);
+    ckpt_value(n);
+    if (!checkpoint_saving())
+      init(cap);
+    for (int i = 0; i < n; i++) {
+      T item;
+      if (checkpoint_saving())
+        item = slots[(head + i) % slots.size()];
+      ckpt_value(item);
+      if (!checkpoint_saving())
+        push(item);
+    }
+  }
+
+  int size() const { return count; }
+  int capacity() const { return limit; }
+  bool empty() const { return count == 0; }
+  bool full() const { return count == limit; }
+
+private:
+  /* Double the storage, unwrapping the held items to the front */
+  void grow() {
+    std::vector<T> bigger(slots.size() * 2 < (size_t)limit ? slots.size() * 2 : limit);
+    for (int i = 0; i < count; i++)
+      bigger[i] = slots[(head + i) % slots.size()];
+    slots.swap(bigger);
+    head = 0;
+  }
+
+  std::vector<T> slots;
+  int limit;    /* most items the buffer will hold */
+  int head;     /* index of the oldest item */
+  int count;    /* number of items held */
+};
+
+#endif
@@ -0,0 +1,87 @@
+#ifndef SEQ_BITMAP_H_
+#define SEQ_BITMAP_H_
+
+#include <stdint.h>
+
+#include "checkpoint.h"
+#include "window_array.h"
+
+/* One bit per sequence number over a sliding window. Sequence numbers */
+/* map onto the bits circularly, so the window can slide forever as    */
+/* long as no more than capacity() sequence numbers are live at once.  */
+/* W is the window when it is fixed at compile time, making capacity() */
+/* a constant and slot() a mask; W = 0 sizes the bitmap in init().     */
+template <int W = 0>
+class seq_bitmap {
+public:
+  /* bits for a window of W, a whole number of words; 0 if W = 0 */
+  static constexpr int bits = (W + 63) / 64 * 64;
+
+  seq_bitmap() : nbits(0) {}
+
+  void init(int window) {
+    int nwords = (window + 63) / 64;
+    words.init(nwords > 0 ? nwords : 1);
+    nbits = words.size() * 64;
+  }
+
+  /* Save or restore the bits, see checkpoint.h */
+  void checkpoint() {
+    words.checkpoint();
+    nbits = words.size() * 64;
+  }
+
+  int capacity() const {
+    if constexpr (W > 0)
+      return bits;
+    else
+      return nbits;
+  }
+  int slot(int seq) const {
+    if constexpr (W > 0)
+      return seq % bits;
+    else
+      return seq % nbits;
+  }
+
+  bool test(int seq) const {
+    int bit = slot(seq);
+    return (words[bit >> 6] >> (bit & 63)) & 1;
+  }
+  void set(int seq) {
+    int bit = slot(seq);
+    words[bit >> 6] |= (uint64_t)1 << (bit & 63);
+  }
+  void clear(int seq) {
+    int bit = slot(seq);
+    words[bit >> 6] &= ~((uint64_t)1 << (bit & 63));
+  }
+
+  /* Number of consecutive set bits starting at seq, at most limit. */
+  /* Scans a word at a time with count-trailing-ones.                 */
+  int run_length(int seq, int limit) const {
+    int n = 0;
+    while (n < limit) {
+      int bit = slot(seq + n);
+      int off = bit & 63;
+      uint64_t zeros = ~(words[bit >> 6] >> off);
+      int ones = zeros ? __builtin_ctzll(zeros) : 64;
+      n += ones;
+      if (ones < 64 - off)
+        break;
+    }
+    return n < limit ? n : limit;
+  }
+
+  /* Clear count bits starting at seq */
+  void clear_run(int seq, int count) {
+    for (int i = 0; i < count; i++)
+      clear(seq + i);
+  }
+
+private:
+  window_array<uint64_t, bits / 64> words;
+  int nbits;
+};
+
+#endif
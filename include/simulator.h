@@ -28,14 +28,33 @@ void A_timerinterrupt();
 void A_init();
 
 void B_input(struct pkt packet);
+void B_timerinterrupt();
 void B_init();
+void protocol_checkpoint();
 
 /* Simulator API */
-void starttimer(int AorB, float increment);
+void starttimer(int AorB, double increment);
 void stoptimer(int AorB);
 void tolayer3(int AorB, struct pkt packet);
+void tolayer3_batch(int AorB, struct pkt *packets, int count);
 void tolayer5(int AorB, char datasent[]);
+void tolayer5_batch(int AorB, struct msg *msgs, int count);
 int getwinsize();
-float get_sim_time();
+int getrcvbufsize();
+float getdrainrate();
+int getnaks();
+int getfecdata();
+int getfecparity();
+int getchannels();
+double gettimeout(double dflt, int inflight);
+int getsndbufsize();
+void layer5_backpressure(int AorB, int full);
+double get_sim_time();
+int getflow();
+int getnflows();
+
+/* Checkpoint API, see checkpoint.h */
+void checkpoint_io(void *data, int len);
+int checkpoint_saving();
 
 #endif
\ No newline at end of file
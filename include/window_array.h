@@ -0,0 +1,80 @@
+#ifndef WINDOW_ARRAY_H_
+#define WINDOW_ARRAY_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <type_traits>
+#include <vector>
+
+#include "checkpoint.h"
+
+/* Per-window storage of N items. With N known at compile time it is an */
+/* array inside the owning struct and size() is a constant, so          */
+/* indexing modulo size() needs no division; N = 0 is a vector sized   */
+/* by init() at run time. Both checkpoint the same way as ckpt_vector. */
+template <typename T, int N>
+class window_array {
+public:
+  void init(int n) {
+    if (n != N) {
+      fprintf(stderr, "window_array: %d items do not fit storage for %d\n", n, N);
+      exit(-1);
+    }
+    for (int i = 0; i < N; i++)
+      items[i] = T();
+  }
+
+  static constexpr int size() { return N; }
+  T &operator[](int i) { return items[i]; }
+  const T &operator[](int i) const { return items[i]; }
+  T *data() { return items; }
+
+  /* Save or restore the items, see checkpoint.h */
+  void checkpoint() {
+    int n = N;
+    ckpt_value(n);
+    if (n != N) {
+      fprintf(stderr, "window_array: checkpoint holds %d items, storage is for %d\n", n, N);
+      exit(-1);
+    }
+    ckpt_array(items, N);
+  }
+
+private:
+  T items[N];
+};
+
+template <typename T>
+class window_array<T, 0> {
+public:
+  void init(int n) { items.assign(n, T()); }
+
+  int size() const { return items.size(); }
+  T &operator[](int i) { return items[i]; }
+  const T &operator[](int i) const { return items[i]; }
+  T *data() { return items.data(); }
+
+  void checkpoint() { ckpt_vector(items); }
+
+private:
+  std::vector<T> items;
+};
+
+/* Call f with std::integral_constant<int, window> if the protocols are */
+/* built for that window at compile time, and with 0 otherwise.        */
+template <typename F>
+void with_window(int window, F f)
+{
+  switch (window) {
+  case 1:  f(std::integral_constant<int, 1>());  break;
+  case 2:  f(std::integral_constant<int, 2>());  break;
+  case 4:  f(std::integral_constant<int, 4>());  break;
+  case 8:  f(std::integral_constant<int, 8>());  break;
+  case 16: f(std::integral_constant<int, 16>()); break;
+  case 32: f(std::integral_constant<int, 32>()); break;
+  case 64: f(std::integral_constant<int, 64>()); break;
+  default: f(std::integral_constant<int, 0>());  break;
+  }
+}
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef WIRE_H_
+#define WIRE_H_
+
+#include "simulator.h"
+
+/* How packets are laid out on the wire, picked with -W.               */
+/*   raw        the flow as an int, then struct pkt as it is in memory */
+/*   compact    a header byte (payload length, checksum width), the    */
+/*              flow, seqnum and acknum as zigzag varints, a 4 byte    */
+/*              checksum and the payload without its trailing zeros,   */
+/*              so an ACK is a header only                             */
+/*   compact16  compact with the checksum cut to its low 16 bits       */
+/* The protocols here all checksum seqnum + acknum + the payload bytes; */
+/* decoding a 16 bit checksum recomputes that sum and keeps it if its  */
+/* low 16 bits match, so a corrupted packet still fails the protocol's */
+/* check unless the damage is a multiple of 65536.                     */
+
+enum wire_format { WIRE_RAW, WIRE_COMPACT, WIRE_COMPACT16 };
+
+#define WIRE_MAX 40   /* longest encoding, compact with three 5 byte varints */
+
+int wire_format_parse(const char *name);
+const char *wire_format_name(int format);
+
+/* encode into buf, which holds WIRE_MAX bytes; returns the length */
+int wire_encode(int format, int flow, const struct pkt *p, unsigned char *buf);
+
+/* decode len bytes; returns 0 if they are not a whole packet */
+int wire_decode(int format, const unsigned char *buf, int len, int *flow, struct pkt *p);
+
+/* encoded length */
+int wire_size(int format, int flow, const struct pkt *p);
+
+#endif
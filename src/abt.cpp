@@ -1,5 +1,7 @@
 #include "../include/simulator.h"
-#include <queue>
+#include "../include/checkpoint.h"
+#include "../include/profile.h"
+#include "../include/ring_buffer.h"
 #include <stdio.h>
 #include <string.h>
 
@@ -18,15 +20,73 @@ using namespace std;
      (although some can be lost).
 **********************************************************************/
 
-queue<struct pkt> pkt_buffer;   /* Queue to hold buffered Packets */
-int nextseq;                    /* Next Sequence Number to use */
-
-static float TIMEOUT = 20;         /* timeout before timer interrupt is called */  
-
-struct pkt last_sent_pkt;       /* Last sent packet */
-int last_seq_num;                /* Last Sequence number delivered */
-bool packet_unacked;             /* boolean to tell if there is a packet unacked */
-int pkts_sent;                  /* Keep track of pkts sent */
+static const float DEFAULT_TIMEOUT = 20;  /* TIMEOUT off a -L path, see gettimeout() */
+static float TIMEOUT;              /* timeout before timer interrupt is called */
+static float MAX_TIMEOUT;          /* cap on the timeout, 16 TIMEOUTs */
+
+/* With -H K, A and B run K alternating bit channels over the link, in  */
+/* the manner of HARQ. Messages go out on the channels in turn, each    */
+/* channel stop-and-wait with its own bit and timeout, so K packets can */
+/* be in flight. A packet's seqnum is 2 * channel + bit. B holds what   */
+/* a channel delivers until the channels before it have delivered too,  */
+/* up to -b messages per channel, and does not ACK a packet it has no   */
+/* room for. K = 1 is plain ABT.                                        */
+/*                                                                      */
+/* The channels share the link, so K packets every TIMEOUT can be more  */
+/* than it carries. A times the packets it sends once and sets the      */
+/* timeout from their round trip time, never below TIMEOUT; and as B    */
+/* ACKs every copy it gets, a second ACK for a packet A resent shows    */
+/* the timeout went off too early, and doubles it.                      */
+
+/* One of A's channels */
+struct channel {
+  int nextseq;                    /* Next Sequence Number to use */
+  struct pkt last_sent_pkt;       /* Last sent packet */
+  bool packet_unacked;            /* boolean to tell if there is a packet unacked */
+  double timesent;                /* When last_sent_pkt last went out */
+  bool resent;                    /* last_sent_pkt went out more than once */
+  int acked_resent;               /* Seqnum of the last packet acked after a resend, -1 if none */
+};
+
+/* A's state, one per flow */
+struct sender {
+  ring_buffer<struct pkt> pkt_buffer;   /* Queue to hold buffered Packets */
+  vector<struct channel> channels;      /* Channels, used in turn */
+  int send_ch;                    /* Channel the next packet goes out on */
+  int timer_ch;                   /* Channel the timer runs for, -1 if none */
+  int pkts_sent;                  /* Keep track of pkts sent */
+  double rto;                     /* Current timeout */
+  double srtt, rttvar;            /* Smoothed round trip time and its variation, srtt < 0 before the first sample */
+
+  void send(struct pkt pkt);
+  void sampleRtt(double rtt);
+  void restartTimer();
+  void output(struct msg message);
+  void input(struct pkt packet);
+  void timerinterrupt();
+  void init();
+  void checkpoint();
+};
+
+/* One of B's channels */
+struct slot {
+  int last_seq_num;                /* Last Sequence number accepted */
+  ring_buffer<struct msg> held;    /* Accepted, waiting for earlier channels */
+};
+
+/* B's state, one per flow */
+struct receiver {
+  vector<struct slot> slots;       /* Channels, delivered in turn */
+  int deliver_ch;                  /* Channel the next message comes from */
+
+  void ack(int seqnum);
+  void input(struct pkt packet);
+  void init();
+  void checkpoint();
+};
+
+vector<struct sender> A_flows;
+vector<struct receiver> B_flows;
 
 void printpacketinfo(struct pkt pkt){;
   printf("Packet Information:\n");
@@ -36,6 +96,7 @@ void printpacketinfo(struct pkt pkt){;
 }
 
 int compute_checksum(struct pkt p){
+  PROFILE_SCOPE("compute_checksum");
   int checksum = 0;
   int payload_sum = 0;
 
@@ -46,8 +107,76 @@ int compute_checksum(struct pkt p){
   return checksum;
 }
 
+/* Channel of a seqnum or acknum, or -1 if no channel has it */
+static int channel_of(int seqnum, int nchannels){
+  if(seqnum < 0 || seqnum / 2 >= nchannels){
+    return -1;
+  }
+  return seqnum / 2;
+}
+
+/* Send a packet on the next channel, which must be free */
+void sender::send(struct pkt pkt)
+{
+  struct channel &ch = channels[send_ch];
+
+  /* Fill out the rest of the packet data*/
+  pkt.seqnum = 2 * send_ch + ch.nextseq;
+  pkt.acknum = pkt.seqnum;
+  pkt.checksum = compute_checksum(pkt);
+  pkts_sent++;
+
+  /* Send to layer 3*/
+  tolayer3(0,pkt);
+  ch.last_sent_pkt = pkt;
+  ch.packet_unacked = true;
+  ch.timesent = get_sim_time();
+  ch.resent = false;
+  if(timer_ch < 0){
+    starttimer(0,rto);
+    timer_ch = send_ch;
+  }
+  send_ch = (send_ch + 1) % channels.size();
+}
+
+/* Set the timeout from the round trip time of a packet sent once */
+void sender::sampleRtt(double rtt)
+{
+  if(srtt < 0){
+    srtt = rtt;
+    rttvar = rtt / 2;
+  }else{
+    rttvar = 0.75 * rttvar + 0.25 * (srtt > rtt ? srtt - rtt : rtt - srtt);
+    srtt = 0.875 * srtt + 0.125 * rtt;
+  }
+  double estimate = srtt + 2 * rttvar;
+  if(estimate < rto){
+    rto = estimate > TIMEOUT ? estimate : TIMEOUT;
+  }
+}
+
+/* Point the timer at the unacked channel that will time out first */
+void sender::restartTimer()
+{
+  timer_ch = -1;
+  for(int i = 0; i < channels.size(); i++){
+    if(channels[i].packet_unacked && (timer_ch < 0 || channels[i].timesent < channels[timer_ch].timesent)){
+      timer_ch = i;
+    }
+  }
+  if(timer_ch < 0){
+    return;
+  }
+
+  double t = rto - (get_sim_time() - channels[timer_ch].timesent);
+  if(t < 0){
+    t = 0;
+  }
+  starttimer(0,t);
+}
+
 /* called from layer 5, passed the data to be sent to other side */
-void A_output(struct msg message)
+void sender::output(struct msg message)
 {
   /* Build new packet */
   pkt pkt;
@@ -55,127 +184,151 @@ void A_output(struct msg message)
   /* Copy Payload data */
   memcpy(pkt.payload,message.data,sizeof(message.data));
 
-  if(pkt_buffer.size() > 0 || packet_unacked == true){
-    /* There is an unacked packet OR there are packets in the buffer - Buffer Packet */
+  if(pkt_buffer.size() > 0 || channels[send_ch].packet_unacked == true){
+    /* The next channel has a packet unacked OR there are packets in the buffer - Buffer Packet */
     pkt_buffer.push(pkt);
+    layer5_backpressure(0,pkt_buffer.full());
   }else{
-    /* No Packets in Buffer AND No Packets on wire - Send Packet to B */
-
-    /* Fill out the rest of the packet data*/
-    pkt.seqnum = nextseq;
-    pkt.acknum = nextseq;
-    pkt.checksum = compute_checksum(pkt);
-    pkts_sent++;
-
-    /* Send to layer 3*/
-    tolayer3(0,pkt);
-    starttimer(0,TIMEOUT);
-    last_sent_pkt = pkt;
-    packet_unacked = true;
-
-
+    /* No Packets in Buffer AND the next channel is free - Send Packet to B */
+    send(pkt);
   }
   
 }
 
 /* called from layer 3, when a packet arrives for layer 4 */
-void A_input(struct pkt packet)
+void sender::input(struct pkt packet)
 {
 
   /* Check if ACK is corrupted */
   int checksum = compute_checksum(packet);
+  int c = channel_of(packet.acknum,channels.size());
   
-  if(checksum != packet.checksum || packet.acknum != last_sent_pkt.seqnum){
+  if(checksum == packet.checksum && c >= 0 && packet.acknum == channels[c].acked_resent){
+    /* Second ACK for a packet sent twice - both copies got through */
+    channels[c].acked_resent = -1;
+    rto = rto * 2 < MAX_TIMEOUT ? rto * 2 : MAX_TIMEOUT;
+
+  }else if(checksum != packet.checksum || c < 0 || packet.acknum != channels[c].last_sent_pkt.seqnum){
     /*  ACK Packet is corrupt or ACK is not for correct packet. 
         Do not stop timer. 
         Allow timerinterrupt() to happen */
   
-  }else if(checksum == packet.checksum && packet.acknum == last_sent_pkt.seqnum){
+  }else if(!channels[c].packet_unacked){
+    /*  Duplicate ACK for a retransmitted packet that is already acked */
+
+  }else{
     /*  Packet is not corrupt AND acknum is correct
-        Process ACK , send another packet from buffer */
+        Process ACK , send more packets from buffer */
     
-    stoptimer(0);
-    packet_unacked = false;
+    channels[c].packet_unacked = false;
+    if(channels[c].resent){
+      channels[c].acked_resent = packet.acknum;
+    }else{
+      channels[c].acked_resent = -1;
+      sampleRtt(get_sim_time() - channels[c].timesent);
+    }
 
     /* Set Next seqnum */
-    if(packet.acknum == 1){
-      nextseq = 0;
-    }else{
-      nextseq = 1;
+    channels[c].nextseq = 1 - channels[c].nextseq;
+
+    /* Move the timer on if it was running for this channel */
+    if(c == timer_ch){
+      stoptimer(0);
+      restartTimer();
     }
 
-    /* Send Next Packet in Buffer to B*/
-    if(pkt_buffer.size() > 0){
+    /* Send Buffered Packets to B while the next channel is free */
+    while(pkt_buffer.size() > 0 && !channels[send_ch].packet_unacked){
 
       struct pkt p = pkt_buffer.front();
       pkt_buffer.pop();
-
-      /* Add values to packet struct */
-      p.seqnum = nextseq;
-      p.acknum = nextseq;
-      p.checksum = compute_checksum(p);
-
-      /* Incremement pkts_sent */
-      pkts_sent ++;
-
-      /* Send Packet to B */
-      starttimer(0,TIMEOUT);
-      tolayer3(0,p);
-      last_sent_pkt = p;
-      packet_unacked = true;
-      
+      layer5_backpressure(0,pkt_buffer.full());
+      send(p);
     }
   }
 }
 /* called when A's timer goes off */
-void A_timerinterrupt()
+void sender::timerinterrupt()
 {
-  /* Send last sent packet again and start the timer */
-  tolayer3(0,last_sent_pkt);
-  starttimer(0,TIMEOUT);
+  /* Send the channel's last sent packet again and start the timer */
+  struct channel &ch = channels[timer_ch];
+
+  tolayer3(0,ch.last_sent_pkt);
+  ch.timesent = get_sim_time();
+  ch.resent = true;
+  restartTimer();
 
 
 }  
 
 /* the following routine will be called once (only) before any other */
 /* entity A routines are called. You can use it to do any initialization */
-void A_init()
+void sender::init()
 {
-  nextseq = 0;              /* start sequence number at 0 */
-  packet_unacked = false;   /* start unacked packet at false */
+  struct channel ch;
+
+  memset(&ch,0,sizeof(ch));
+  ch.nextseq = 0;           /* start sequence number at 0 */
+  ch.packet_unacked = false;  /* start unacked packet at false */
+  ch.last_sent_pkt.seqnum = -1;
+  ch.resent = false;
+  ch.acked_resent = -1;
+  channels.assign(getchannels(),ch);
+  send_ch = 0;
+  timer_ch = -1;
   pkts_sent = 0;
+  TIMEOUT = gettimeout(DEFAULT_TIMEOUT, channels.size());
+  MAX_TIMEOUT = 16 * TIMEOUT;
+  rto = TIMEOUT;
+  srtt = -1;
+  rttvar = 0;
+  pkt_buffer.init(getsndbufsize());
+}
+
+/* ACK a packet B has or had */
+void receiver::ack(int seqnum)
+{
+  pkt ackpkt;
+  memset(&ackpkt,0,sizeof(ackpkt));   /* ACKs carry no payload */
+  ackpkt.seqnum = seqnum;
+  ackpkt.acknum = seqnum;
+  ackpkt.checksum = compute_checksum(ackpkt);
+  tolayer3(1,ackpkt);
 }
 
 /* Note that with simplex transfer from a-to-B, there is no B_output() */
 /* called from layer 3, when a packet arrives for layer 4 at B*/
-void B_input(struct pkt packet)
+void receiver::input(struct pkt packet)
 {
-  /* Packet is valid - Send ACK to A and send to layer5 */
-
   int checksum = 0;
   checksum = compute_checksum(packet);
-
-  if(checksum == packet.checksum && packet.seqnum != last_seq_num){
-    /* Pass data to Layer 5 */
-    last_seq_num = packet.seqnum;
-    tolayer5(1,packet.payload);
+  int c = channel_of(packet.seqnum,slots.size());
+
+  if(c < 0){
+    /* Do Nothing, no such channel - the seqnum is corrupt */
+
+  }else if(checksum == packet.checksum && packet.seqnum != slots[c].last_seq_num && !slots[c].held.full()){
+    /* Packet is valid - hold it for its turn */
+    struct msg m;
+    memcpy(m.data,packet.payload,sizeof(packet.payload));
+    slots[c].last_seq_num = packet.seqnum;
+    slots[c].held.push(m);
+
+    /* Pass data to Layer 5, in channel order */
+    while(!slots[deliver_ch].held.empty()){
+      tolayer5(1,slots[deliver_ch].held.front().data);
+      slots[deliver_ch].held.pop();
+      deliver_ch = (deliver_ch + 1) % slots.size();
+    }
 
     /* Packet is valid. Send ack to A */
-    pkt ackpkt;
-    ackpkt.seqnum = packet.seqnum;
-    ackpkt.acknum = packet.seqnum;
-    ackpkt.checksum = compute_checksum(ackpkt);
-    tolayer3(1,ackpkt);
-
-  }else if(packet.seqnum == last_seq_num){
-    pkt ackpkt;
-    ackpkt.seqnum = packet.seqnum;
-    ackpkt.acknum = packet.seqnum;
-    ackpkt.checksum = compute_checksum(ackpkt);
-    tolayer3(1,ackpkt);
+    ack(packet.seqnum);
+
+  }else if(packet.seqnum == slots[c].last_seq_num){
+    ack(packet.seqnum);
 
   }else{
-      /* Do Nothing Packet is Corrupt. This will force A to send based on timeout. */
+      /* Do Nothing Packet is Corrupt, or its channel has no room. This will force A to send based on timeout. */
   }
 
 
@@ -183,7 +336,86 @@ void B_input(struct pkt packet)
 
 /* the following rouytine will be called once (only) before any other */
 /* entity B routines are called. You can use it to do any initialization */
+void receiver::init()
+{
+  slots.assign(getchannels(),slot());
+  for(int i = 0; i < slots.size(); i++){
+    slots[i].last_seq_num = 2 * i + 1;
+    slots[i].held.init(getrcvbufsize());
+  }
+  deliver_ch = 0;
+}
+
+/* save or restore one flow's state, see checkpoint.h */
+void sender::checkpoint()
+{
+  pkt_buffer.checkpoint();
+  ckpt_vector(channels);
+  ckpt_value(send_ch);
+  ckpt_value(timer_ch);
+  ckpt_value(pkts_sent);
+  ckpt_value(rto);
+  ckpt_value(srtt);
+  ckpt_value(rttvar);
+}
+
+void receiver::checkpoint()
+{
+  for(int i = 0; i < slots.size(); i++){
+    ckpt_value(slots[i].last_seq_num);
+    slots[i].held.checkpoint();
+  }
+  ckpt_value(deliver_ch);
+}
+
+/* Simulator entry points, each runs the current flow's A or B */
+void A_output(struct msg message)
+{
+  A_flows[getflow()].output(message);
+}
+
+void A_input(struct pkt packet)
+{
+  A_flows[getflow()].input(packet);
+}
+
+void A_timerinterrupt()
+{
+  A_flows[getflow()].timerinterrupt();
+}
+
+void A_init()
+{
+  A_flows.resize(getnflows());
+  for(int i = 0; i < getnflows(); i++){
+    A_flows[i].init();
+  }
+}
+
+void B_input(struct pkt packet)
+{
+  B_flows[getflow()].input(packet);
+}
+
+/* called when B's timer goes off - B does not use a timer */
+void B_timerinterrupt()
+{
+}
+
 void B_init()
 {
-  last_seq_num = 1;
+  B_flows.resize(getnflows());
+  for(int i = 0; i < getnflows(); i++){
+    B_flows[i].init();
+  }
+}
+
+/* save or restore A and B state of every flow, see checkpoint.h */
+void protocol_checkpoint()
+{
+  ckpt_tag("ABT");
+  for(int i = 0; i < getnflows(); i++){
+    A_flows[i].checkpoint();
+    B_flows[i].checkpoint();
+  }
 }
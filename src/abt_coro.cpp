@@ -0,0 +1,86 @@
+#include "../include/coro.h"
+#include "../include/profile.h"
+
+#include <stdio.h>
+#include <string.h>
+
+using namespace std;
+using namespace coro;
+
+/* ******************************************************************
+ ALTERNATING BIT as coroutines, see coro.h. Each endpoint is one loop
+ over the protocol's steps; what abt.cpp keeps in struct sender and
+ struct receiver lives in the locals of A_main() and B_main(). It sends
+ the same packets at the same times as abt.cpp.
+**********************************************************************/
+
+static const float DEFAULT_TIMEOUT = 20;  /* TIMEOUT off a -L path, see gettimeout() */
+static float TIMEOUT;              /* timeout before the packet is sent again */
+
+int compute_checksum(struct pkt p){
+  PROFILE_SCOPE("compute_checksum");
+  int checksum = 0;
+  int payload_sum = 0;
+
+  for(int i = 0; i < sizeof(p.payload); i ++){
+    payload_sum = payload_sum + p.payload[i];
+  }
+  checksum = p.seqnum + p.acknum + payload_sum;
+  return checksum;
+}
+
+/* A: send each message, and send it again every TIMEOUT until its ACK */
+/* comes back intact                                                   */
+endpoint A_main()
+{
+  int nextseq = 0;
+
+  TIMEOUT = gettimeout(DEFAULT_TIMEOUT, 1);
+  for(;;){
+    struct msg message = co_await app_message();
+    struct pkt p;
+    memcpy(p.payload,message.data,sizeof(message.data));
+    p.seqnum = nextseq;
+    p.acknum = nextseq;
+    p.checksum = compute_checksum(p);
+    tolayer3(0,p);
+
+    /* ACKs that are corrupt or for the other bit leave the timer running */
+    double sent_at = get_sim_time();
+    for(;;){
+      optional<struct pkt> ack = co_await next_packet(TIMEOUT - (get_sim_time() - sent_at));
+      if(!ack){
+        tolayer3(0,p);
+        sent_at = get_sim_time();
+      }else if(ack->checksum == compute_checksum(*ack) && ack->acknum == p.seqnum){
+        break;
+      }
+    }
+    nextseq = 1 - nextseq;
+  }
+}
+
+/* B: deliver each new packet once and ACK it, and ACK again anything */
+/* carrying the last delivered seqnum, as abt.cpp does                */
+endpoint B_main()
+{
+  int last_seq_num = 1;
+
+  for(;;){
+    struct pkt packet = co_await next_packet();
+    if(packet.checksum == compute_checksum(packet) && packet.seqnum != last_seq_num){
+      last_seq_num = packet.seqnum;
+      tolayer5(1,packet.payload);
+    }else if(packet.seqnum != last_seq_num){
+      /* Corrupt - A sends again on its timeout */
+      continue;
+    }
+
+    struct pkt ackpkt;
+    memset(&ackpkt,0,sizeof(ackpkt));   /* ACKs carry no payload */
+    ackpkt.seqnum = packet.seqnum;
+    ackpkt.acknum = packet.seqnum;
+    ackpkt.checksum = compute_checksum(ackpkt);
+    tolayer3(1,ackpkt);
+  }
+}
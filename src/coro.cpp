@@ -0,0 +1,142 @@
+#include "../include/coro.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+using namespace std;
+
+/* ******************************************************************
+ Simulator entry points for protocols written as coroutines, see
+ coro.h. Each one queues what it was handed for the current flow's
+ endpoint and resumes the endpoint's frame if it is waiting for it.
+**********************************************************************/
+
+namespace coro {
+
+thread_local endpoint_state *running = NULL;
+
+vector<endpoint_state> A_endpoints;
+vector<endpoint_state> B_endpoints;
+
+/* A's messages not yet taken stand in for its send buffer */
+void A_backpressure(endpoint_state *ep)
+{
+  layer5_backpressure(0,ep->messages.full());
+}
+
+/* run the endpoint until it waits again */
+static void resume(endpoint_state *ep)
+{
+  endpoint_state *saved = running;
+
+  running = ep;
+  ep->waiting = RUNNING;
+  ep->frame.resume();
+  running = saved;
+}
+
+/* the current flow's endpoint, its frame started on first use */
+static endpoint_state *current(vector<endpoint_state> &endpoints)
+{
+  endpoint_state *ep = &endpoints[getflow()];
+  endpoint_state *saved = running;
+
+  if(!ep->started){
+    ep->started = true;
+    ep->messages.init(getsndbufsize());
+    ep->packets.init(INT_MAX);
+    running = ep;
+    ep->waiting = RUNNING;
+    if(ep->entity == 0){
+      A_main();
+    }else{
+      B_main();
+    }
+    running = saved;
+  }
+  return ep;
+}
+
+static void packet_arrived(endpoint_state *ep, struct pkt packet)
+{
+  ep->packets.push(packet);
+  if(ep->waiting == PACKET){
+    resume(ep);
+  }else if(ep->waiting == PACKET_OR_TIMER){
+    stoptimer(ep->entity);
+    resume(ep);
+  }
+}
+
+static void timer_expired(endpoint_state *ep)
+{
+  if(ep->waiting == PACKET_OR_TIMER || ep->waiting == TIMER){
+    resume(ep);
+  }
+}
+
+static void init(vector<endpoint_state> &endpoints, int entity)
+{
+  endpoints.assign(getnflows(), endpoint_state());
+  for(int i = 0; i < getnflows(); i++){
+    endpoints[i].entity = entity;
+    endpoints[i].started = false;
+    endpoints[i].waiting = RUNNING;
+  }
+}
+
+}
+
+using namespace coro;
+
+/* A takes messages after it resumes, so a message it is waiting for */
+/* never counts against the send buffer                              */
+void A_output(struct msg message)
+{
+  endpoint_state *ep = current(A_endpoints);
+
+  ep->messages.push(message);
+  if(ep->waiting == MESSAGE){
+    resume(ep);
+  }
+  A_backpressure(ep);
+}
+
+void A_input(struct pkt packet)
+{
+  packet_arrived(current(A_endpoints),packet);
+}
+
+void A_timerinterrupt()
+{
+  timer_expired(current(A_endpoints));
+}
+
+void A_init()
+{
+  init(A_endpoints,0);
+}
+
+void B_input(struct pkt packet)
+{
+  packet_arrived(current(B_endpoints),packet);
+}
+
+void B_timerinterrupt()
+{
+  timer_expired(current(B_endpoints));
+}
+
+void B_init()
+{
+  init(B_endpoints,1);
+}
+
+/* a suspended frame cannot be written out */
+void protocol_checkpoint()
+{
+  fprintf(stderr, "Coroutine protocols cannot be checkpointed\n");
+  exit(-1);
+}
@@ -0,0 +1,246 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <ctype.h>
+#include <string.h>
+
+#include "../include/frontend.h"
+
+/*****************************************************************
+ Command line and checks shared by every backend, see frontend.h.
+ Each backend links this file and keeps its own clock, its own
+ options and the rest of the simulator API.
+******************************************************************/
+
+int TRACE = 1;             /* for my debugging */
+int seed;
+int nsimmax = 0;           /* number of msgs to generate, then stop */
+float lossprob;            /* probability that a packet is dropped  */
+float corruptprob;         /* probability that one bit is packet is flipped */
+float lambda;              /* arrival rate of messages from layer 5 */
+
+int win_size;
+int rcv_bufsize = 0;       /* receiver buffer in packets, 0 = window size */
+float drain_rate = 0;      /* layer5 consume rate at B, 0 = immediate */
+int naks = 0;              /* B sends NAKs (GBN and SR) */
+int fec_data = 0;          /* SR FEC data packets per block, 0 = off */
+int fec_parity = 1;        /* SR FEC parity packets per block */
+int channels = 1;          /* ABT stop-and-wait channels run in parallel */
+int sndbuf_size = 1000;    /* capacity of A's send buffer in packets */
+int bp_policy = BP_BLOCK;  /* what layer5 does when A's buffer is full */
+int nflows = 1;            /* sender/receiver pairs */
+
+/**
+ * Checks if the array pointed to by input holds a valid number.
+ *
+ * @param  input char* to the array holding the value.
+ * @return TRUE or FALSE
+ */
+int isNumber(char *input)
+{
+    while (*input){
+        if (!isdigit(*input))
+            return 0;
+        else
+            input += 1;
+    }
+
+    return 1;
+}
+
+int read_arg_int(char c)
+{
+    if(!isNumber(optarg)) {
+        fprintf(stderr, "Invalid value for -%c\n", c);
+        exit(-1);
+    }
+    return atoi(optarg);
+}
+
+float read_arg_float(char c)
+{
+    float val = atof(optarg);
+    if(val < 0.0 || val > 1.0){
+        fprintf(stderr, "Invalid value for -%c\n", c);
+        exit(-1);
+    }
+    return val;
+}
+
+int missing_args(const char *seen, const char *required)
+{
+    for (; *required != '\0'; required++)
+        if (!seen[(unsigned char)*required])
+            return 1;
+    return 0;
+}
+
+int read_common_option(int opt)
+{
+    switch (opt){
+        case 's':   seed = read_arg_int(opt);
+                    break;
+        case 'w':   win_size = read_arg_int(opt);
+                    break;
+        case 'm':     nsimmax = read_arg_int(opt);
+                    break;
+        case 'l':     lossprob = read_arg_float(opt);
+                    break;
+        case 'c':     corruptprob = read_arg_float(opt);
+                    break;
+        case 't':     if((lambda = atof(optarg)) <= 0.0){
+                        fprintf(stderr, "Invalid value for -%c\n", opt);
+                        exit(-1);
+                    }
+                    break;
+        case 'v':     TRACE = read_arg_int(opt);
+                    break;
+        case 'b':     rcv_bufsize = read_arg_int(opt);
+                    break;
+        case 'd':     if((drain_rate = atof(optarg)) < 0.0){
+                        fprintf(stderr, "Invalid value for -%c\n", opt);
+                        exit(-1);
+                    }
+                    break;
+        case 'n':     naks = 1;
+                    break;
+        case 'e':     if(sscanf(optarg, "%d:%d", &fec_data, &fec_parity) < 1 || fec_data <= 0 || fec_parity <= 0){
+                        fprintf(stderr, "Invalid value for -%c\n", opt);
+                        exit(-1);
+                    }
+                    break;
+        case 'H':     channels = atoi(optarg);
+                    if(channels <= 0){
+                        fprintf(stderr, "Invalid value for -%c\n", opt);
+                        exit(-1);
+                    }
+                    break;
+        case 'q':     if((sndbuf_size = read_arg_int(opt)) <= 0){
+                        fprintf(stderr, "Invalid value for -%c\n", opt);
+                        exit(-1);
+                    }
+                    break;
+        case 'p':     if(strcmp(optarg, "block") == 0)
+                        bp_policy = BP_BLOCK;
+                    else if(strcmp(optarg, "drop") == 0)
+                        bp_policy = BP_DROP;
+                    else if(strcmp(optarg, "defer") == 0)
+                        bp_policy = BP_DEFER;
+                    else{
+                        fprintf(stderr, "Invalid value for -%c\n", opt);
+                        exit(-1);
+                    }
+                    break;
+        case 'f':     if((nflows = read_arg_int(opt)) <= 0){
+                        fprintf(stderr, "Invalid value for -%c\n", opt);
+                        exit(-1);
+                    }
+                    break;
+        default:    return 0;
+    }
+    return 1;
+}
+
+void display_usage(char *filename, const char *more)
+{
+    printf("Usage:\n %s -s Seed -w Window size -m Number of messages to simulate -l Loss -c Corruption -t Average time between messages from sender's layer5 -v Tracing\n", filename);
+    printf("Optional:\n -b Receiver buffer size in packets -d Receiver layer5 drain rate in messages/time unit\n");
+    printf(" -n NAK lost and corrupt packets (GBN and SR) -e FEC data packets[:parity packets] per block (SR)\n");
+    printf(" -H Stop-and-wait channels run in parallel (ABT)\n");
+    printf(" -q Sender buffer size in packets -p Sender back-pressure policy (block, drop or defer)\n");
+    printf(" -f Number of flows\n");
+    printf("%s", more);
+}
+
+void check_delivery(const char *expected, const char *datasent)
+{
+    int i;
+
+    /* Check for non-existent packet */
+    if (expected == NULL) {
+        printf("PANIC: Unexpected/Non-existent packet!");
+        exit(52);
+    }
+
+    /* Check for out-of-order/duplicate packets */
+    if (strncmp(expected, datasent, 20) != 0) {
+        printf("Expected: ");
+        for (i=0; i<20; i++)
+            printf("%c", expected[i]);
+        printf("\nGot: ");
+        for (i=0; i<20; i++)
+            printf("%c", datasent[i]);
+        exit(63);
+    }
+}
+
+int sender_backpressure(struct backpressure *bp, int full, double now)
+{
+    if (full == bp->A_full)
+        return 0;
+
+    bp->A_full = full;
+    if (full) {
+        bp->full_since = now;
+        return 0;
+    }
+
+    bp->stall_time += now - bp->full_since;
+    if (!bp->arrival_blocked)
+        return 0;
+    /* resume the arrival process with the message that was held back */
+    bp->arrival_blocked = 0;
+    return 1;
+}
+
+double sender_stall(const struct backpressure *bp, double now)
+{
+    return bp->stall_time + (bp->A_full ? now - bp->full_since : 0);
+}
+
+/********************** Student-callable ROUTINES ***********************/
+
+int getsndbufsize()
+{
+    return sndbuf_size;
+}
+
+int getwinsize()
+{
+    return win_size;
+}
+
+int getrcvbufsize()
+{
+    return rcv_bufsize > 0 ? rcv_bufsize : win_size;
+}
+
+float getdrainrate()
+{
+    return drain_rate;
+}
+
+int getnaks()
+{
+    return naks;
+}
+
+int getfecdata()
+{
+    return fec_data;
+}
+
+int getfecparity()
+{
+    return fec_parity;
+}
+
+int getchannels()
+{
+    return channels;
+}
+
+int getnflows()
+{
+    return nflows;
+}
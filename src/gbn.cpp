@@ -1,6 +1,9 @@
 #include "../include/simulator.h"
+#include "../include/checkpoint.h"
+#include "../include/profile.h"
+#include "../include/ring_buffer.h"
+#include "../include/window_array.h"
 
-#include <queue>
 #include <stdio.h>
 #include <string.h>
 
@@ -25,22 +28,58 @@ struct windowItem{
   int acked;
 };
 
-queue<struct pkt> A_pkt_buffer;   /* Queue to hold buffered send packets */
-
-struct pkt pkts_sent[1000];       /* Packets Sent */
-int A_last_ack_rcvd;              /* Last ACK Rcvd before timeout */
-
-int N;                            /* Max Window Size */
+//float MIN_TIMEOUT;                /* Minimum Timeout Value */
+static const float DEFAULT_TIMEOUT = 30;  /* TIMEOUT off a -L path, see gettimeout() */
+static float TIMEOUT;               /* timeout before timer interrupt is called */
+static float MAX_TIMEOUT;           /* cap on the backed off timeout, 16 TIMEOUTs */
+static const int NAK = -1;          /* seqnum of a packet from B asking for acknum again */
+
+/* A's state, one per flow; W is the window size, or 0 if it is only */
+/* known at run time                                                  */
+template <int W>
+struct sender {
+  ring_buffer<struct pkt> A_pkt_buffer;   /* Queue to hold buffered send packets */
+
+  window_array<struct pkt, W> pkts_sent;   /* Packets Sent, indexed by seqnum % N */
+  int A_last_ack_rcvd;              /* Last ACK Rcvd, -1 before the first */
+
+  int N;                            /* Max Window Size */
+
+  int base;                         /* Base of window */
+  int nextseqnum;                   /* Next Seq Number */
+  double rto;                       /* Current timeout, doubled on expiry and reset when base advances */
+
+  void sendRange(int first,int last);
+  void sendBuffered();
+  void output(struct msg message);
+  void input(struct pkt packet);
+  void timerinterrupt();
+  void init();
+  void checkpoint();
+};
 
-int base;                         /* Base of window */
-int nextseqnum;                   /* Next Seq Number */
+/* B's state, one per flow */
+struct receiver {
+  int expectedseqnum;               /* Expected seqnum of next packet */
+  int last_delivered_seqnum;        /* Store last delivered seqnumber */
+  bool naks;                        /* NAK gaps and corrupt packets (-n) */
+  int naked_seqnum;                 /* expectedseqnum already NAKed, -1 if none */
+
+  void send_nak();
+  void input(struct pkt packet);
+  void init();
+  void checkpoint();
+};
 
-//float MAX_TIMEOUT;                /* Max Timeout Value */
-//float MIN_TIMEOUT;                /* Minimum Timeout Value */
-static float TIMEOUT = 30;          /* timeout before timer interrupt is called */   
+template <int W> vector<struct sender<W> > A_flows;
+vector<struct receiver> B_flows;
 
-int expectedseqnum;               /* Expected seqnum of next packet */
-int last_delivered_seqnum;        /* Store last delivered seqnumber */
+/* Run f on the senders built for the current window size */
+template <typename F>
+void with_senders(F f)
+{
+  with_window(getwinsize(),[&](auto w){ f(A_flows<decltype(w)::value>); });
+}
 
 void printpacketinfo(struct pkt pkt){;
   printf("Packet Information:\n");
@@ -51,7 +90,23 @@ void printpacketinfo(struct pkt pkt){;
   printf("Payload Length = %lu\n\n",strlen(pkt.payload));
 }
 
+/* Send packets first .. last-1 from pkts_sent as one burst */
+template <int W>
+void sender<W>::sendRange(int first,int last){
+  int slots = pkts_sent.size();
+  int from = first % slots;
+  int count = last - first;
+  if(from + count > slots){
+    /* Range wraps around the end of pkts_sent */
+    tolayer3_batch(0,&pkts_sent[from],slots - from);
+    count = count - (slots - from);
+    from = 0;
+  }
+  tolayer3_batch(0,&pkts_sent[from],count);
+}
+
 int compute_checksum(struct pkt p){
+  PROFILE_SCOPE("compute_checksum");
   int checksum = 0;
   int payload_sum = 0;
 
@@ -63,7 +118,8 @@ int compute_checksum(struct pkt p){
 }
 
 /* called from layer 5, passed the data to be sent to other side */
-void A_output(struct msg message)
+template <int W>
+void sender<W>::output(struct msg message)
 {
 
   /* Build new packet */
@@ -71,6 +127,7 @@ void A_output(struct msg message)
 
   /* Copy Payload data */
   memcpy(pkt.payload,message.data,sizeof(message.data));
+  pkt.acknum = 0;   /* Data packets ack nothing */
   
   /* check if next seqnum is outside of window OR there are buffered packets */
   if(nextseqnum < base + N && A_pkt_buffer.size() == 0){
@@ -79,14 +136,14 @@ void A_output(struct msg message)
     pkt.checksum = compute_checksum(pkt);
 
     /* Add packet to packets sent */
-    pkts_sent[nextseqnum] = pkt;
+    pkts_sent[nextseqnum % pkts_sent.size()] = pkt;
 
     tolayer3(0,pkt);
     
 
     /* Move Window Forward by setting base to seq num */
     if(base == nextseqnum){
-      starttimer(0,TIMEOUT);
+      starttimer(0,rto);
     }
 
     /* increment next seq num */
@@ -94,11 +151,44 @@ void A_output(struct msg message)
   }else{
     /* Buffer Packet to be sent later */
     A_pkt_buffer.push(pkt);
+    layer5_backpressure(0,A_pkt_buffer.full());
   }
 }
 
+/* Send buffered packets into the space the window has */
+template <int W>
+void sender<W>::sendBuffered(){
+  int first = nextseqnum;
+  while(nextseqnum < base + N && A_pkt_buffer.size() > 0){
+
+    /* Pop Front of buffer */
+    struct pkt pkt = A_pkt_buffer.front();
+    A_pkt_buffer.pop();
+
+    /* Send Packet */
+    pkt.seqnum = nextseqnum;
+    pkt.checksum = compute_checksum(pkt);
+
+    /* Add Packet to pkts sent */
+    pkts_sent[nextseqnum % pkts_sent.size()] = pkt;
+
+    /* Move Window Forward by setting base to seq num */
+    if(base == nextseqnum){
+      starttimer(0,rto);
+    }
+
+    /* Increment Next Seq Num */
+    nextseqnum++;
+  }
+
+  /* Send the new packets to B as one burst */
+  sendRange(first,nextseqnum);
+  layer5_backpressure(0,A_pkt_buffer.full());
+}
+
 /* called from layer 3, when a packet arrives for layer 4 */
-void A_input(struct pkt packet)
+template <int W>
+void sender<W>::input(struct pkt packet)
 {
 
   /* Check if ACK is corrupted */
@@ -107,81 +197,85 @@ void A_input(struct pkt packet)
   if(checksum != packet.checksum){
     /* ACK Corrupted. Let Timeout */
 
-  }else{
-    /* Update Packet in Packet Window as ACKED */
+  }else if(packet.seqnum == NAK && packet.acknum >= base && packet.acknum < nextseqnum){
+    /* B got everything before acknum - go back to it now instead of at the timeout */
+    if(packet.acknum > base){
+      base = packet.acknum;
+      A_last_ack_rcvd = packet.acknum - 1;
+      rto = TIMEOUT;
+    }
+    stoptimer(0);
+    starttimer(0,rto);
+    sendRange(base,nextseqnum);
+    sendBuffered();
+  }else if(packet.seqnum != NAK && packet.acknum >= base && packet.acknum < nextseqnum){
+    /* Cumulative ACK inside the window - B got something new */
+    rto = TIMEOUT;
 
-    
     /* Increment Base */
     base = packet.acknum + 1;
     A_last_ack_rcvd = packet.acknum;
 
-
-    if(base == nextseqnum){
-      stoptimer(0);
-      /* B has received entire window. Stop Timer*/
-
-      /* Send Next Packet in Buffer */
-      if(A_pkt_buffer.size() > 0){  
-        int i = 1;
-        while(i < N && A_pkt_buffer.size() > 0){
-
-          /* Pop Front of buffer */
-          struct pkt pkt = A_pkt_buffer.front();
-          A_pkt_buffer.pop();
-
-          /* Make sure sequence number is not outside the window */
-          if(nextseqnum < base + N){
-
-          /* Send Packet */
-          pkt.seqnum = nextseqnum;
-          pkt.checksum = compute_checksum(pkt);
-      
-          /* Add Packet to pkts sent */
-          pkts_sent[nextseqnum] = pkt;
-      
-          /* Send packet to B */
-          tolayer3(0,pkt);
-      
-          /* Move Window Forward by setting base to seq num */
-          if(base == nextseqnum){
-            starttimer(0,TIMEOUT);
-          }
-
-          /* Increment Next Seq Num */
-          nextseqnum++;
-        }
-        i++;
-      }
+    /* Restart timer for the remaining window, stop it if B has received the entire window */
+    stoptimer(0);
+    if(base != nextseqnum){
+      starttimer(0,rto);
     }
+
+    sendBuffered();
   }else{
-    starttimer(0,TIMEOUT);
-    }
+    /* Duplicate ACK or stale NAK - base did not move, let the timer run */
   }
 }
 
 /* called when A's timer goes off */
-void A_timerinterrupt()
+template <int W>
+void sender<W>::timerinterrupt()
 {
-  base = A_last_ack_rcvd;
-  starttimer(0,TIMEOUT);
-  for(int i = base; i < nextseqnum; i++){
-    struct pkt p = pkts_sent[i];
-    tolayer3(0,p);
-  }
+  /* Back off, so a channel slower than the timeout is not flooded with */
+  /* the whole window every TIMEOUT                                     */
+  rto = rto * 2 < MAX_TIMEOUT ? rto * 2 : MAX_TIMEOUT;
+  starttimer(0,rto);
+
+  /* Resend the whole window as one burst */
+  sendRange(base,nextseqnum);
 }  
 
 /* the following routine will be called once (only) before any other */
 /* entity A routines are called. You can use it to do any initialization */
-void A_init()
+template <int W>
+void sender<W>::init()
 {
   base = 0;                 /* Start base at 1 */
   nextseqnum = 0;           /* Start nextseqnum at 1 */
   N = getwinsize();         /* Window Size */
+  A_last_ack_rcvd = -1;
+  TIMEOUT = gettimeout(DEFAULT_TIMEOUT, N);
+  MAX_TIMEOUT = 16 * TIMEOUT;
+  rto = TIMEOUT;
+  pkts_sent.init(N);
+  A_pkt_buffer.init(getsndbufsize());
+}
+
+/* Ask A to go back to expectedseqnum, once for each expectedseqnum; */
+/* if the NAK or what it brings is lost, A's timeout still recovers   */
+void receiver::send_nak()
+{
+  if(!naks || naked_seqnum == expectedseqnum){
+    return;
+  }
+  struct pkt p;
+  memset(&p,0,sizeof(p));
+  p.seqnum = NAK;
+  p.acknum = expectedseqnum;
+  p.checksum = compute_checksum(p);
+  naked_seqnum = expectedseqnum;
+  tolayer3(1,p);
 }
 
 /* Note that with simplex transfer from a-to-B, there is no B_output() */
 /* called from layer 3, when a packet arrives for layer 4 at B*/
-void B_input(struct pkt packet)
+void receiver::input(struct pkt packet)
 {
 
   int checksum = 0;
@@ -193,6 +287,7 @@ void B_input(struct pkt packet)
 
     /* Send ACK Packet to A*/
     struct pkt p;
+    memset(&p,0,sizeof(p));   /* ACKs carry no payload */
     p.acknum = expectedseqnum;
     p.checksum = compute_checksum(p);
     last_delivered_seqnum = expectedseqnum;
@@ -201,10 +296,15 @@ void B_input(struct pkt packet)
     /* Incremement expected seq num by 1 */
     expectedseqnum++;
   }else if(checksum != packet.checksum){
-    /* Do Nothing. Let Sender Timeout and resend window */
+    /* Do Nothing. Let Sender Timeout and resend window, or NAK */
+    send_nak();
+  }else if(naks && packet.seqnum > expectedseqnum && naked_seqnum != expectedseqnum){
+    /* Gap - expectedseqnum was lost */
+    send_nak();
   }else{
     /* Send ACK for last packet */
     struct pkt p;
+    memset(&p,0,sizeof(p));   /* ACKs carry no payload */
     p.acknum = last_delivered_seqnum; 
     p.checksum = compute_checksum(p);
     tolayer3(1,p);
@@ -213,7 +313,84 @@ void B_input(struct pkt packet)
 
 /* the following rouytine will be called once (only) before any other */
 /* entity B routines are called. You can use it to do any initialization */
-void B_init()
+void receiver::init()
 {
   expectedseqnum = 0;
+  last_delivered_seqnum = -1;   /* nothing delivered yet, duplicate ACKs are ignored by A */
+  naks = getnaks();
+  naked_seqnum = -1;
+}
+
+/* save or restore one flow's state, see checkpoint.h */
+template <int W>
+void sender<W>::checkpoint()
+{
+  A_pkt_buffer.checkpoint();
+  ckpt_value(N);
+  ckpt_value(base);
+  ckpt_value(nextseqnum);
+  ckpt_value(A_last_ack_rcvd);
+  ckpt_value(rto);
+  pkts_sent.checkpoint();
+}
+
+void receiver::checkpoint()
+{
+  ckpt_value(expectedseqnum);
+  ckpt_value(last_delivered_seqnum);
+  ckpt_value(naked_seqnum);
+}
+
+/* Simulator entry points, each runs the current flow's A or B */
+void A_output(struct msg message)
+{
+  with_senders([&](auto &flows){ flows[getflow()].output(message); });
+}
+
+void A_input(struct pkt packet)
+{
+  with_senders([&](auto &flows){ flows[getflow()].input(packet); });
+}
+
+void A_timerinterrupt()
+{
+  with_senders([&](auto &flows){ flows[getflow()].timerinterrupt(); });
+}
+
+void A_init()
+{
+  with_senders([&](auto &flows){
+    flows.resize(getnflows());
+    for(int i = 0; i < getnflows(); i++){
+      flows[i].init();
+    }
+  });
+}
+
+void B_input(struct pkt packet)
+{
+  B_flows[getflow()].input(packet);
+}
+
+/* called when B's timer goes off - B does not use a timer */
+void B_timerinterrupt()
+{
+}
+
+void B_init()
+{
+  B_flows.resize(getnflows());
+  for(int i = 0; i < getnflows(); i++){
+    B_flows[i].init();
+  }
+}
+
+/* save or restore A and B state of every flow, see checkpoint.h */
+void protocol_checkpoint()
+{
+  ckpt_tag("GBN");
+  for(int i = 0; i < getnflows(); i++){
+    with_senders([&](auto &flows){ flows[i].checkpoint(); });
+    B_flows[i].checkpoint();
+  }
 }
@@ -0,0 +1,94 @@
+#include "../include/profile.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/* ******************************************************************
+ The report behind PROFILE_SCOPE and the allocation counters, see
+ profile.h. Linked into every program when it is built with PROFILE=1.
+**********************************************************************/
+
+#ifdef PROFILE
+
+static std::atomic<profile_hook *> hooks(NULL);
+static std::atomic<unsigned long long> nmalloc(0), nfree(0), alloc_bytes(0);
+static unsigned long long run_start = profile_now();
+
+profile_hook::profile_hook(const char *n) : name(n), calls(0), ticks(0)
+{
+  next = hooks.load();
+  while (!hooks.compare_exchange_weak(next, this))
+    ;
+}
+
+/* glibc's allocator under the counting wrappers below */
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *p, size_t size);
+void __libc_free(void *p);
+
+void *malloc(size_t size)
+{
+  nmalloc.fetch_add(1, std::memory_order_relaxed);
+  alloc_bytes.fetch_add(size, std::memory_order_relaxed);
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+  nmalloc.fetch_add(1, std::memory_order_relaxed);
+  alloc_bytes.fetch_add(n * size, std::memory_order_relaxed);
+  return __libc_calloc(n, size);
+}
+
+/* counted as an allocation of the new size */
+void *realloc(void *p, size_t size)
+{
+  nmalloc.fetch_add(1, std::memory_order_relaxed);
+  alloc_bytes.fetch_add(size, std::memory_order_relaxed);
+  return __libc_realloc(p, size);
+}
+
+void free(void *p)
+{
+  if (p != NULL)
+    nfree.fetch_add(1, std::memory_order_relaxed);
+  __libc_free(p);
+}
+}
+
+static int by_ticks(const void *a, const void *b)
+{
+  unsigned long long x = (*(profile_hook **)a)->ticks, y = (*(profile_hook **)b)->ticks;
+  return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/* one line per hook, most expensive first */
+static void profile_report()
+{
+  profile_hook *h, *sorted[256];
+  unsigned long long total = profile_now() - run_start;
+  unsigned long long calls;
+  int n = 0, i;
+
+  fflush(stdout);
+  for (h = hooks.load(); h != NULL && n < 256; h = h->next)
+    sorted[n++] = h;
+  qsort(sorted, n, sizeof(profile_hook *), by_ticks);
+
+  fprintf(stderr, "\nProfile: %llu %s in total, hooks include the hooks they call\n", total, PROFILE_UNIT);
+  fprintf(stderr, "%-20s %12s %16s %12s %8s\n", "hook", "calls", PROFILE_UNIT, "per call", "% run");
+  for (i = 0; i < n; i++) {
+    calls = sorted[i]->calls;
+    fprintf(stderr, "%-20s %12llu %16llu %12.1f %7.2f%%\n", sorted[i]->name, calls,
+            (unsigned long long)sorted[i]->ticks, calls > 0 ? (double)sorted[i]->ticks / calls : 0,
+            total > 0 ? 100.0 * sorted[i]->ticks / total : 0);
+  }
+  fprintf(stderr, "Allocations: %llu, %llu bytes; frees: %llu\n",
+          (unsigned long long)nmalloc, (unsigned long long)alloc_bytes, (unsigned long long)nfree);
+}
+
+static int report_registered = atexit(profile_report);
+
+#endif
@@ -0,0 +1,346 @@
+#include "../include/reliable.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace std;
+
+/* ******************************************************************
+ libreliable: connections, the simulated backend, and the simulator API
+ the protocols call, routed to whichever connection is current.
+**********************************************************************/
+
+namespace reliable {
+
+/* the connection whose protocol code is running */
+static thread_local connection *current = NULL;
+
+/* each protocol's flows, one per open connection */
+struct slot_table {
+  int nslots;
+  vector<int> free_slots;
+};
+static slot_table slots[3];
+static long next_id = 1;
+
+static const protocol_ops *ops_of(protocol p)
+{
+  switch (p) {
+  case protocol::abt: return &abt_ops;
+  case protocol::gbn: return &gbn_ops;
+  default:            return &sr_ops;
+  }
+}
+
+connection::connection(protocol p, backend &b, const options &o)
+  : be(b), opts(o), proto(p), A_full(0), ops(ops_of(p)), conn_id(next_id++)
+{
+  slot_table &t = slots[(int)proto];
+  connection *saved = current;
+
+  if (!t.free_slots.empty()) {
+    slot = t.free_slots.back();
+    t.free_slots.pop_back();
+  } else {
+    slot = t.nslots++;
+  }
+
+  current = this;
+  ops->open(slot);
+  current = saved;
+  be.attach(*this);
+}
+
+connection::~connection()
+{
+  be.detach(*this);
+  slots[(int)proto].free_slots.push_back(slot);
+}
+
+void connection::send(span<const byte> data)
+{
+  struct msg m;
+  size_t n;
+
+  while (data.size() > 0) {
+    n = data.size() < segment_bytes ? data.size() : segment_bytes;
+    memset(&m, 0, sizeof(m));
+    m.data[0] = (char)n;
+    memcpy(m.data + 1, data.data(), n);
+    waiting.push_back(m);
+    data = data.subspan(n);
+  }
+
+  connection *saved = current;
+  current = this;
+  feed();
+  current = saved;
+}
+
+/* hand queued segments to A until its buffer fills */
+void connection::feed()
+{
+  while (!waiting.empty() && !A_full) {
+    ops->A_output(waiting.front());
+    sent += waiting.front().data[0];
+    waiting.pop_front();
+  }
+}
+
+void connection::arrived(int entity, const struct pkt &packet)
+{
+  connection *saved = current;
+  current = this;
+  if (entity == 0)
+    ops->A_input(packet);
+  else
+    ops->B_input(packet);
+  feed();
+  current = saved;
+}
+
+void connection::expired(int entity)
+{
+  connection *saved = current;
+  current = this;
+  if (entity == 0)
+    ops->A_timerinterrupt();
+  else
+    ops->B_timerinterrupt();
+  feed();
+  current = saved;
+}
+
+void connection::deliver(const char *data)
+{
+  size_t n = (unsigned char)data[0];
+
+  if (n > segment_bytes)
+    n = segment_bytes;
+  delivered += n;
+  if (recv_cb)
+    recv_cb(span<const byte>((const byte *)data + 1, n));
+}
+
+/************************** SIM BACKEND ***************/
+
+/* splitmix64, as streamrand() in the simulator */
+float sim_backend::random()
+{
+  unsigned long long z = (stream += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  z ^= z >> 31;
+  return (z >> 33) / 2147483647.0;
+}
+
+/* same draws, in the same order, as channel_decide() */
+void sim_backend::send(connection &c, int from, const struct pkt &packet)
+{
+  event ev;
+  double lastime;
+  float x;
+
+  packets++;
+  if (random() < lossprob) {
+    lost++;
+    return;
+  }
+
+  ev.conn = c.id();
+  ev.entity = (from + 1) % 2;
+  ev.timer = 0;
+  ev.packet = packet;
+  ev.seq = seq++;
+  lastime = clock;
+  if (last_arrival[ev.entity] > lastime)
+    lastime = last_arrival[ev.entity];
+  ev.time = lastime + 1 + 9*random();
+  last_arrival[ev.entity] = ev.time;
+
+  if (random() < corruptprob) {
+    corrupted++;
+    if ((x = random()) < .75)
+      ev.packet.payload[0] = 'Z';
+    else if (x < .875)
+      ev.packet.seqnum = 999999;
+    else
+      ev.packet.acknum = 999999;
+  }
+  events.push(ev);
+}
+
+/* like the simulator, starting a running timer leaves it as it is */
+void sim_backend::start_timer(connection &c, int entity, double increment)
+{
+  int &running = timers[make_pair(c.id(), entity)];
+  event ev;
+
+  if (running != 0)
+    return;
+  running = ++generation;
+  ev.time = clock + increment;
+  ev.seq = seq++;
+  ev.conn = c.id();
+  ev.entity = entity;
+  ev.timer = running;
+  events.push(ev);
+}
+
+/* a stopped timer's event stays queued and is ignored when it comes up */
+void sim_backend::stop_timer(connection &c, int entity)
+{
+  timers[make_pair(c.id(), entity)] = 0;
+}
+
+void sim_backend::detach(connection &c)
+{
+  live.erase(c.id());
+  timers.erase(make_pair(c.id(), 0));
+  timers.erase(make_pair(c.id(), 1));
+}
+
+bool sim_backend::step()
+{
+  map<long, connection *>::iterator c;
+  event ev;
+
+  if (events.empty())
+    return false;
+  ev = events.top();
+  events.pop();
+  clock = ev.time;
+
+  if ((c = live.find(ev.conn)) == live.end())
+    return true;
+  if (ev.timer == 0) {
+    c->second->arrived(ev.entity, ev.packet);
+  } else {
+    int &running = timers[make_pair(ev.conn, ev.entity)];
+    if (running != ev.timer)
+      return true;
+    running = 0;
+    c->second->expired(ev.entity);
+  }
+  return true;
+}
+
+}
+
+/************************** SIMULATOR API ***************/
+/* what the protocols call, on behalf of the current connection */
+
+using reliable::current;
+
+void starttimer(int AorB, double increment)
+{
+  current->be.start_timer(*current, AorB, increment);
+}
+
+void stoptimer(int AorB)
+{
+  current->be.stop_timer(*current, AorB);
+}
+
+void tolayer3(int AorB, struct pkt packet)
+{
+  current->be.send(*current, AorB, packet);
+}
+
+void tolayer3_batch(int AorB, struct pkt *packets, int count)
+{
+  int i;
+  for (i=0; i<count; i++)
+     current->be.send(*current, AorB, packets[i]);
+}
+
+void tolayer5(int AorB, char *datasent)
+{
+  current->deliver(datasent);
+}
+
+void tolayer5_batch(int AorB, struct msg *msgs, int count)
+{
+  int i;
+  for (i=0; i<count; i++)
+     current->deliver(msgs[i].data);
+}
+
+/* A is full: connection::feed() holds segments back until it has room */
+void layer5_backpressure(int AorB, int full)
+{
+  if (AorB == 0)
+     current->A_full = full;
+}
+
+int getwinsize()
+{
+  return current->opts.window;
+}
+
+int getrcvbufsize()
+{
+  return current->opts.rcvbuf > 0 ? current->opts.rcvbuf : current->opts.window;
+}
+
+float getdrainrate()
+{
+  return current->opts.drain_rate;
+}
+
+int getnaks()
+{
+  return current->opts.naks;
+}
+
+int getfecdata()
+{
+  return current->opts.fec_data;
+}
+
+int getfecparity()
+{
+  return current->opts.fec_parity;
+}
+
+int getchannels()
+{
+  return current->opts.channels;
+}
+
+/* a real path has no -L to take its round trip from */
+double gettimeout(double dflt, int inflight)
+{
+  return dflt;
+}
+
+int getsndbufsize()
+{
+  return current->opts.sndbuf;
+}
+
+double get_sim_time()
+{
+  return current->be.now();
+}
+
+int getflow()
+{
+  return current->slot;
+}
+
+int getnflows()
+{
+  return reliable::slots[(int)current->proto].nslots;
+}
+
+/* connections are not checkpointed */
+void checkpoint_io(void *data, int len)
+{
+}
+
+int checkpoint_saving()
+{
+  return 0;
+}
@@ -0,0 +1,41 @@
+#include "../include/reliable.h"
+#include "../include/checkpoint.h"
+#include "../include/profile.h"
+#include "../include/ring_buffer.h"
+#include "../include/seq_bitmap.h"
+#include "../include/window_array.h"
+
+#include <deque>
+#include <queue>
+#include <stdio.h>
+#include <string.h>
+
+/* ABT for libreliable: abt.cpp in a namespace of its own, so the three */
+/* protocols link into one library side by side. The headers it       */
+/* includes are already in, so only its own code lands in the         */
+/* namespace; what it calls is the simulator API in reliable.cpp.     */
+namespace reliable_abt {
+
+#include "abt.cpp"
+
+/* set up A and B of one flow, growing the flows for a new slot */
+void open(int slot)
+{
+  if(slot >= (int)A_flows.size()){
+    A_flows.resize(slot + 1);
+    B_flows.resize(slot + 1);
+  }
+  A_flows[slot].init();
+  B_flows[slot].init();
+}
+
+}
+
+const reliable::protocol_ops reliable::abt_ops = {
+  reliable_abt::open,
+  reliable_abt::A_output,
+  reliable_abt::A_input,
+  reliable_abt::A_timerinterrupt,
+  reliable_abt::B_input,
+  reliable_abt::B_timerinterrupt,
+};
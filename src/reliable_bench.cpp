@@ -0,0 +1,121 @@
+#include "../include/reliable.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <vector>
+
+using namespace std;
+
+/* ******************************************************************
+ Streams random bytes through a libreliable connection over the
+ simulated backend, checks that B receives exactly what A sent, and
+ reports goodput in simulated time and the library's wall-clock rate.
+**********************************************************************/
+
+void display_usage(char *filename)
+{
+    printf("Usage:\n %s -p Protocol (abt, gbn or sr) -s Seed -w Window size -l Loss -c Corruption -n Bytes per send -m Number of sends -q Sender buffer size in packets -N NAK lost and corrupt packets -e FEC data packets[:parity packets] per block -H ABT channels -D Give up at this time\n", filename);
+}
+
+int main(int argc, char **argv)
+{
+   reliable::options opts;
+   reliable::protocol proto = reliable::protocol::gbn;
+   unsigned long long seed = 1;
+   float loss = 0, corrupt = 0;
+   long nbytes = 1000, nsends = 1000;
+   double deadline = 5000000;
+   int opt;
+
+   while((opt = getopt(argc, argv,"p:s:w:l:c:n:m:q:Ne:H:D:")) != -1){
+        switch (opt) {
+            case 'p':   if (strcmp(optarg, "abt") == 0)
+                            proto = reliable::protocol::abt;
+                        else if (strcmp(optarg, "gbn") == 0)
+                            proto = reliable::protocol::gbn;
+                        else if (strcmp(optarg, "sr") == 0)
+                            proto = reliable::protocol::sr;
+                        else {
+                            fprintf(stderr, "Invalid value for -p\n");
+                            display_usage(argv[0]);
+                            exit(-1);
+                        }
+                        break;
+            case 's':   seed = atoll(optarg);
+                        break;
+            case 'w':   opts.window = atoi(optarg);
+                        break;
+            case 'l':   loss = atof(optarg);
+                        break;
+            case 'c':   corrupt = atof(optarg);
+                        break;
+            case 'n':   nbytes = atol(optarg);
+                        break;
+            case 'm':   nsends = atol(optarg);
+                        break;
+            case 'q':   opts.sndbuf = atoi(optarg);
+                        break;
+            case 'N':   opts.naks = 1;
+                        break;
+            case 'e':   sscanf(optarg, "%d:%d", &opts.fec_data, &opts.fec_parity);
+                        break;
+            case 'H':   opts.channels = atoi(optarg);
+                        break;
+            case 'D':   deadline = atof(optarg);
+                        break;
+            default:    fprintf(stderr, "Invalid arguments!\n");
+                        display_usage(argv[0]);
+                        exit(-1);
+        }
+   }
+   if (opts.window < 1 || opts.sndbuf < 1 || nbytes < 1 || nsends < 1) {
+      fprintf(stderr, "Invalid arguments!\n");
+      display_usage(argv[0]);
+      exit(-1);
+   }
+
+   /* the whole stream, so B can be checked against it */
+   vector<std::byte> data(nbytes * nsends);
+   unsigned long long x = seed;
+   for (size_t i = 0; i < data.size(); i++) {
+      x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+      data[i] = (std::byte)(x >> 56);
+   }
+
+   reliable::sim_backend be(seed, loss, corrupt);
+   reliable::connection conn(proto, be, opts);
+   size_t received = 0;
+   int mismatch = 0;
+
+   conn.on_recv([&](std::span<const std::byte> seg) {
+      if (received + seg.size() > data.size() ||
+          memcmp(seg.data(), &data[received], seg.size()) != 0)
+         mismatch = 1;
+      received += seg.size();
+   });
+
+   struct timeval start, end;
+   gettimeofday(&start, NULL);
+
+   /* a send at a time, letting the backend drain A's backlog in between */
+   for (long i = 0; i < nsends; i++) {
+      conn.send(std::span<const std::byte>(&data[i * nbytes], nbytes));
+      while (conn.backlog() > 0 && be.now() < deadline && be.step())
+         ;
+   }
+   be.run_until(deadline);
+
+   gettimeofday(&end, NULL);
+   double wall = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+
+   printf("[PA2]%ld bytes sent, %ld received, %s[/PA2]\n", (long)data.size(), (long)received,
+          mismatch ? "MISMATCH" : received != data.size() ? "incomplete at the deadline" : "identical");
+   printf("[PA2]%d packets sent by A and B, %d lost, %d corrupted[/PA2]\n", be.packets, be.lost, be.corrupted);
+   printf("[PA2]Total time: %f time units[/PA2]\n", be.now());
+   printf("[PA2]Goodput: %f bytes/time units[/PA2]\n", be.now() > 0 ? received / be.now() : 0);
+   printf("[PA2]Wall clock: %f s, %f MB/s[/PA2]\n", wall, wall > 0 ? received / wall / 1e6 : 0);
+   return mismatch || received != data.size();
+}
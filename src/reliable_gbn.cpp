@@ -0,0 +1,46 @@
+#include "../include/reliable.h"
+#include "../include/checkpoint.h"
+#include "../include/profile.h"
+#include "../include/ring_buffer.h"
+#include "../include/seq_bitmap.h"
+#include "../include/window_array.h"
+
+#include <deque>
+#include <queue>
+#include <stdio.h>
+#include <string.h>
+
+/* GBN for libreliable: gbn.cpp in a namespace of its own, so the three */
+/* protocols link into one library side by side. The headers it       */
+/* includes are already in, so only its own code lands in the         */
+/* namespace; what it calls is the simulator API in reliable.cpp.     */
+namespace reliable_gbn {
+
+#include "gbn.cpp"
+
+/* set up A and B of one flow, growing the flows for a new slot; A's */
+/* are the ones built for this connection's window size               */
+void open(int slot)
+{
+  with_senders([&](auto &flows){
+    if(slot >= (int)flows.size()){
+      flows.resize(slot + 1);
+    }
+    flows[slot].init();
+  });
+  if(slot >= (int)B_flows.size()){
+    B_flows.resize(slot + 1);
+  }
+  B_flows[slot].init();
+}
+
+}
+
+const reliable::protocol_ops reliable::gbn_ops = {
+  reliable_gbn::open,
+  reliable_gbn::A_output,
+  reliable_gbn::A_input,
+  reliable_gbn::A_timerinterrupt,
+  reliable_gbn::B_input,
+  reliable_gbn::B_timerinterrupt,
+};
@@ -0,0 +1,48 @@
+#include "../include/reliable.h"
+#include "../include/checkpoint.h"
+#include "../include/profile.h"
+#include "../include/ring_buffer.h"
+#include "../include/seq_bitmap.h"
+#include "../include/window_array.h"
+
+#include <deque>
+#include <queue>
+#include <stdio.h>
+#include <string.h>
+
+/* SR for libreliable: sr.cpp in a namespace of its own, so the three */
+/* protocols link into one library side by side. The headers it       */
+/* includes are already in, so only its own code lands in the         */
+/* namespace; what it calls is the simulator API in reliable.cpp.     */
+namespace reliable_sr {
+
+#include "sr.cpp"
+
+/* set up A and B of one flow, growing the flows for a new slot; they */
+/* are the ones built for this connection's window size                */
+void open(int slot)
+{
+  with_senders([&](auto &flows){
+    if(slot >= (int)flows.size()){
+      flows.resize(slot + 1);
+    }
+    flows[slot].init();
+  });
+  with_receivers([&](auto &flows){
+    if(slot >= (int)flows.size()){
+      flows.resize(slot + 1);
+    }
+    flows[slot].init();
+  });
+}
+
+}
+
+const reliable::protocol_ops reliable::sr_ops = {
+  reliable_sr::open,
+  reliable_sr::A_output,
+  reliable_sr::A_input,
+  reliable_sr::A_timerinterrupt,
+  reliable_sr::B_input,
+  reliable_sr::B_timerinterrupt,
+};
@@ -0,0 +1,632 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <ctype.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <atomic>
+
+#include "../include/frontend.h"
+
+/*****************************************************************
+ Shared memory backend. A and B run the same protocol code as the
+ simulator, but as two processes (B is forked off A) that exchange
+ packets through two lock-free single-producer/single-consumer rings
+ in one shared mapping, in wall-clock time.
+  - tolayer3() writes the packet straight into a ring slot; the slots
+    written during one pass of the event loop are published with a
+    single store of the ring's head
+  - a side with nothing to do either spins (-y busy) or sleeps on a
+    futex until a packet is published or its next timer is due
+    (-y futex)
+  - loss and corruption are applied before a packet is published, with
+    the same probabilities and the same kinds of corruption as the
+    simulator
+ A time unit is -u microseconds of wall-clock time.
+******************************************************************/
+
+#define  A    0
+#define  B    1
+
+#define  RING_SLOTS     4096   /* packets per ring, a power of two */
+#define  MAX_SLEEP      10     /* longest futex wait in milliseconds */
+
+#define  WAIT_BUSY       0
+#define  WAIT_FUTEX      1
+
+struct wire_pkt {
+  int flow;
+  struct pkt packet;
+};
+
+/* one direction; only the sending process writes head, only the */
+/* receiving process writes tail                                 */
+struct ring {
+  alignas(64) std::atomic<unsigned> head;   /* slots published by the sender */
+  alignas(64) std::atomic<unsigned> tail;   /* slots consumed by the receiver */
+  alignas(64) std::atomic<int> doorbell;    /* futex word, bumped to wake the receiver */
+  std::atomic<int> sleeping;                /* receiver is about to wait on doorbell */
+  alignas(64) struct wire_pkt slots[RING_SLOTS];
+};
+
+/* what B reports back to A, per flow */
+struct shared_flow {
+  std::atomic<int> B_transport, B_application;
+};
+
+/* the shared mapping: this header, then nflows shared_flows, then */
+/* nflows * nletters letters A has accepted, so B can check order  */
+struct segment {
+  struct ring to[2];         /* to[A] carries packets for A, to[B] for B */
+  std::atomic<int> B_application;
+  std::atomic<int> done;     /* A has finished, B should exit */
+  struct timespec start_time;
+};
+
+/* this process's view of one flow */
+struct local_flow {
+  int timer_running;
+  double timer_due;          /* time the own entity's timer goes off */
+  int arrival_armed;
+  double arrival_due;        /* time of the next layer5 arrival (A) */
+  int A_application, A_transport, B_application;
+  int nsim;                  /* messages from layer5 so far */
+  struct backpressure bp;    /* A's buffer as layer5 sees it */
+  int ndropped_l5;           /* messages dropped by back-pressure */
+};
+
+struct segment *seg;
+struct shared_flow *shared_flows;
+char *letters;
+int nletters;              /* letters kept per flow, a power of two */
+struct local_flow *flows;
+int me;                    /* entity this process runs, A or B */
+unsigned out_head;         /* head of the outgoing ring, not yet published */
+int cur_flow = 0;          /* flow whose event is being handled */
+
+float drain_deadline = 1000;  /* give up after this long without a delivery */
+int nblocked = 0;          /* flows with an arrival held back by -p block */
+double unit_usec = 1000;   /* length of a time unit in microseconds */
+int wait_mode = WAIT_FUTEX;
+
+int nsim = 0;              /* number of messages from 5 to 4 so far */
+
+/* Statistics, each process counts its own side */
+int A_application = 0;
+int A_transport = 0;
+int B_application = 0;
+int B_transport = 0;
+int nlost = 0;             /* number lost by the shim */
+int ncorrupt = 0;          /* number corrupted by the shim */
+long npublished = 0;       /* packets put into the outgoing ring */
+long nring_dropped = 0;    /* the outgoing ring was full */
+long nwakeups = 0;         /* futex wakes issued */
+double last_msg_time = 0;  /* time the last message left layer5 at A */
+
+float jimsrand()
+{
+  double mmm = 2147483647;
+  return rand()/mmm;
+}
+
+/* wall-clock time since the start of the run, in time units */
+double now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((ts.tv_sec - seg->start_time.tv_sec)*1e6 + (ts.tv_nsec - seg->start_time.tv_nsec)/1e3) / unit_usec;
+}
+
+long futex(std::atomic<int> *word, int op, int val, struct timespec *timeout)
+{
+  return syscall(SYS_futex, (int *)word, op, val, timeout, NULL, 0);
+}
+
+/************************** RINGS ***************/
+
+/* make the packets written since the last call visible to the other side */
+void publish()
+{
+  struct ring *r = &seg->to[1-me];
+
+  if (out_head == r->head.load(std::memory_order_relaxed))
+     return;
+  r->head.store(out_head);
+  if (r->sleeping.load()) {
+     r->doorbell.fetch_add(1);
+     futex(&r->doorbell, FUTEX_WAKE, 1, NULL);
+     nwakeups++;
+     }
+}
+
+/* hand every published packet to this side's entity; returns how many */
+int receive()
+{
+  struct ring *r = &seg->to[me];
+  struct wire_pkt w;
+  unsigned head, tail;
+  int n = 0;
+
+  head = r->head.load(std::memory_order_acquire);
+  for (tail = r->tail.load(std::memory_order_relaxed); tail != head; tail++) {
+     w = r->slots[tail % RING_SLOTS];
+     r->tail.store(tail + 1, std::memory_order_release);
+     n++;
+     if (w.flow < 0 || w.flow >= nflows)
+        continue;
+     cur_flow = w.flow;
+     if (TRACE>=2)
+        printf("\nEVENT time: %f, fromlayer3 entity: %d flow: %d\n", now(), me, cur_flow);
+     if (me == A)
+        A_input(w.packet);
+      else {
+        B_transport += 1;
+        shared_flows[cur_flow].B_transport.fetch_add(1, std::memory_order_relaxed);
+        B_input(w.packet);
+      }
+     }
+  return n;
+}
+
+/* nothing to do until due: spin, or sleep until the other side publishes */
+void idle(double due)
+{
+  struct ring *r = &seg->to[me];
+  struct timespec ts;
+  double wait;
+  int bell;
+
+  if (wait_mode == WAIT_BUSY)
+     return;
+  wait = (due - now()) * unit_usec;      /* microseconds */
+  if (wait <= 0)
+     return;
+  if (wait > MAX_SLEEP * 1000)
+     wait = MAX_SLEEP * 1000;
+  ts.tv_sec = 0;
+  ts.tv_nsec = (long)(wait * 1000);
+  bell = r->doorbell.load();
+  r->sleeping.store(1);
+  if (r->head.load() == r->tail.load(std::memory_order_relaxed) && !seg->done.load())
+     futex(&r->doorbell, FUTEX_WAIT, bell, &ts);
+  r->sleeping.store(0);
+}
+
+/************************** LAYER5 ARRIVALS ***************/
+
+void generate_next_arrival(int flow)
+{
+  flows[flow].arrival_armed = 1;
+  flows[flow].arrival_due = now() + lambda*jimsrand()*2;   /* uniform on [0,2*lambda] */
+}
+
+char *flow_letter(int flow, int n)
+{
+  return &letters[(long)flow * nletters + (n & (nletters - 1))];
+}
+
+void layer5_arrival(int flow)
+{
+  struct local_flow *f = &flows[flow];
+  struct msg msg2give;
+  int i;
+
+  cur_flow = flow;
+  f->arrival_armed = 0;
+  if (nsim >= nsimmax)
+     return;
+  if (f->bp.A_full && bp_policy != BP_DROP) {
+     /* A's buffer is full - hold layer5 back */
+     if (bp_policy == BP_BLOCK) {
+        f->bp.arrival_blocked = 1;   /* layer5_backpressure() resumes arrivals */
+        nblocked++;
+        }
+      else {
+        f->arrival_armed = 1;
+        f->arrival_due = now() + lambda;
+      }
+     if (TRACE>0)
+        printf("          MAINLOOP: sender buffer full, arrival held back\n");
+     return;
+     }
+  generate_next_arrival(flow);
+  for (i=0; i<20; i++)
+     msg2give.data[i] = 97 + f->nsim % 26;
+  f->nsim++;
+  nsim++;
+  last_msg_time = now();
+  if (TRACE>=2)
+     printf("\nEVENT time: %f, fromlayer5 entity: 0 flow: %d\n", last_msg_time, flow);
+  if (f->bp.A_full) {
+     /* BP_DROP: A's buffer is full, message is lost at the sender */
+     f->ndropped_l5 += 1;
+     if (TRACE>0)
+        printf("          MAINLOOP: sender buffer full, message dropped\n");
+     return;
+     }
+  /* written before the packets carrying it are published */
+  *flow_letter(flow, f->A_application) = msg2give.data[0];
+  A_application += 1;
+  f->A_application += 1;
+  A_output(msg2give);
+}
+
+/* run timers and arrivals that are due; returns how many, and the */
+/* time of the earliest one still pending in *next                 */
+int run_due(double *next)
+{
+  struct local_flow *f;
+  double t = now();
+  int flow, n = 0;
+
+  *next = t + MAX_SLEEP * 1000 / unit_usec;
+  for (flow=0; flow<nflows; flow++) {
+     f = &flows[flow];
+     if (f->timer_running && f->timer_due <= t) {
+        cur_flow = flow;
+        f->timer_running = 0;
+        if (TRACE>=2)
+           printf("\nEVENT time: %f, timerinterrupt entity: %d flow: %d\n", t, me, flow);
+        if (me == A)
+           A_timerinterrupt();
+         else
+           B_timerinterrupt();
+        n++;
+        }
+     if (f->arrival_armed && f->arrival_due <= t) {
+        layer5_arrival(flow);
+        n++;
+        }
+     if (f->timer_running && f->timer_due < *next)
+        *next = f->timer_due;
+     if (f->arrival_armed && f->arrival_due < *next)
+        *next = f->arrival_due;
+     }
+  return n;
+}
+
+/************************** MAIN LOOP ***************/
+
+/* the shared memory backend's own options, after the common ones in display_usage() */
+const char usage_more[] =
+    " -D Give up once nothing has been delivered for this many time units after the last message\n"
+    " -u Length of a time unit in microseconds\n"
+    " -y What an idle side does (busy or futex)\n";
+
+/* B's process: serve packets and timers until A says it is done */
+void run_B()
+{
+  double next;
+  int n;
+
+  B_init();
+  while (!seg->done.load(std::memory_order_relaxed)) {
+     n = receive();
+     n += run_due(&next);
+     publish();
+     if (n == 0)
+        idle(next);
+     }
+  fflush(stdout);
+  _exit(0);
+}
+
+/* A's process; returns once every accepted message is delivered, or */
+/* nothing has been delivered for -D time units after the last message */
+/* or while -p block holds layer5 back                                 */
+void run_A()
+{
+  double next, progress;
+  int n, delivered, seen = 0;
+
+  A_init();
+  for (n=0; n<nflows; n++)
+     generate_next_arrival(n);
+  progress = 0;
+  while (1) {
+     delivered = seg->B_application.load(std::memory_order_relaxed);
+     if (delivered != seen) {
+        seen = delivered;
+        progress = now();
+        }
+     if (nsim >= nsimmax || nblocked > 0) {
+        if (nsim >= nsimmax && delivered == A_application)
+           break;
+        if (now() > (progress > last_msg_time ? progress : last_msg_time) + drain_deadline)
+           break;
+        }
+     n = receive();
+     n += run_due(&next);
+     publish();
+     if (n == 0)
+        idle(next);
+     }
+  seg->done.store(1);
+  seg->to[B].doorbell.fetch_add(1);
+  futex(&seg->to[B].doorbell, FUTEX_WAKE, 1, NULL);
+}
+
+int main(int argc, char **argv)
+{
+   struct rusage ru_a, ru_b;
+   struct local_flow *f;
+   double wall, cpu_a, cpu_b, stall_total;
+   size_t size;
+   pid_t pid;
+   int i, opt, dropped_total, status;
+   char seen[128];
+   void *map;
+
+   memset(seen, 0, sizeof(seen));
+
+    while((opt = getopt(argc, argv, COMMON_OPTIONS "D:u:y:")) != -1){
+        seen[(unsigned char)opt] = 1;
+        if (read_common_option(opt))
+            continue;
+        switch (opt){
+            case 'D':     if((drain_deadline = atof(optarg)) <= 0.0){
+                            fprintf(stderr, "Invalid value for -%c\n", opt);
+                            exit(-1);
+                        }
+                        break;
+            case 'u':     if((unit_usec = atof(optarg)) <= 0.0){
+                            fprintf(stderr, "Invalid value for -%c\n", opt);
+                            exit(-1);
+                        }
+                        break;
+            case 'y':     if(strcmp(optarg, "busy") == 0)
+                            wait_mode = WAIT_BUSY;
+                        else if(strcmp(optarg, "futex") == 0)
+                            wait_mode = WAIT_FUTEX;
+                        else{
+                            fprintf(stderr, "Invalid value for -%c\n", opt);
+                            exit(-1);
+                        }
+                        break;
+            case '?':
+               default:    fprintf(stderr, "Invalid arguments!\n");
+                        display_usage(argv[0], usage_more);
+                        return -1;
+       }
+    }
+
+   if (missing_args(seen, "swmlctv")) {
+        fprintf(stderr, "Missing arguments!\n");
+        display_usage(argv[0], usage_more);
+        return -1;
+   }
+
+   /* B is never more than A's buffer, the window and B's buffer behind */
+   for (nletters = 64; nletters < 2*(sndbuf_size + win_size + getrcvbufsize()); nletters *= 2)
+      ;
+   size = sizeof(struct segment) + nflows * sizeof(struct shared_flow) + (size_t)nflows * nletters;
+   map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+   if (map == MAP_FAILED) {
+      perror("mmap");
+      return -1;
+      }
+   seg = (struct segment *)map;        /* zero filled, which is a valid empty state */
+   shared_flows = (struct shared_flow *)(seg + 1);
+   letters = (char *)(shared_flows + nflows);
+   flows = (struct local_flow *)calloc(nflows, sizeof(struct local_flow));
+   clock_gettime(CLOCK_MONOTONIC, &seg->start_time);
+
+   fflush(stdout);
+   if ((pid = fork()) < 0) {
+      perror("fork");
+      return -1;
+      }
+   if (pid == 0) {
+      me = B;
+      srand(seed + 1);
+      run_B();
+      }
+   me = A;
+   srand(seed);
+   run_A();
+   wall = now();
+   waitpid(pid, &status, 0);
+
+   getrusage(RUSAGE_SELF, &ru_a);
+   getrusage(RUSAGE_CHILDREN, &ru_b);
+   cpu_a = ru_a.ru_utime.tv_sec + ru_a.ru_utime.tv_usec/1e6 + ru_a.ru_stime.tv_sec + ru_a.ru_stime.tv_usec/1e6;
+   cpu_b = ru_b.ru_utime.tv_sec + ru_b.ru_utime.tv_usec/1e6 + ru_b.ru_stime.tv_sec + ru_b.ru_stime.tv_usec/1e6;
+   B_application = seg->B_application.load();
+   B_transport = 0;
+   for (i=0; i<nflows; i++)
+      B_transport += shared_flows[i].B_transport.load();
+
+   printf(" Simulator terminated at time %f\n after sending %d msgs from layer5\n", wall, nsim);
+   printf("\n");
+   printf("[PA2]%d packets sent from the Application Layer of Sender A[/PA2]\n", A_application);
+   printf("[PA2]%d packets sent from the Transport Layer of Sender A[/PA2]\n", A_transport);
+   printf("[PA2]%d packets received at the Transport layer of Receiver B[/PA2]\n", B_transport);
+   printf("[PA2]%d packets received at the Application layer of Receiver B[/PA2]\n", B_application);
+   printf("[PA2]Total time: %f time units[/PA2]\n", wall);
+   printf("[PA2]Throughput: %f packets/time units[/PA2]\n", B_application/wall);
+   printf("[PA2]Wall clock: %f s, %f messages/s[/PA2]\n", wall*unit_usec/1e6, B_application/(wall*unit_usec/1e6));
+   printf("[PA2]CPU time: A %f s, B %f s, %f us per message[/PA2]\n", cpu_a, cpu_b,
+          B_application > 0 ? (cpu_a + cpu_b)*1e6/B_application : 0);
+   printf("[PA2]%ld packets published by A, %ld dropped at a full ring, %ld futex wakes[/PA2]\n",
+          npublished, nring_dropped, nwakeups);
+
+   stall_total = 0;
+   dropped_total = 0;
+   for (i=0; i<nflows; i++) {
+      stall_total += sender_stall(&flows[i].bp, wall);
+      dropped_total += flows[i].ndropped_l5;
+      }
+   printf("[PA2]%d messages dropped by sender back-pressure[/PA2]\n", dropped_total);
+   printf("[PA2]Sender stall time: %f time units[/PA2]\n", stall_total);
+   if (B_application != A_application)
+      printf("[PA2]%d messages still undelivered at the deadline[/PA2]\n", A_application - B_application);
+   if (nflows > 1)
+      for (i=0; i<nflows; i++) {
+         f = &flows[i];
+         printf("[PA2]Flow %d: %d sent, %d delivered, %d transport packets from A, %d at B, %f packets/time units[/PA2]\n",
+                i, f->A_application, shared_flows[i].B_application.load(), f->A_transport,
+                shared_flows[i].B_transport.load(), shared_flows[i].B_application.load()/wall);
+         }
+   return 0;
+}
+
+/********************** Student-callable ROUTINES ***********************/
+
+void stoptimer(int AorB)
+{
+ struct local_flow *f = &flows[cur_flow];
+
+ if (TRACE>2)
+    printf("          STOP TIMER: stopping timer at %f\n", now());
+ if (f->timer_running) {
+    f->timer_running = 0;
+    return;
+    }
+  printf("Warning: unable to cancel your timer. It wasn't running.\n");
+}
+
+void starttimer(int AorB,double increment)
+{
+ struct local_flow *f = &flows[cur_flow];
+
+ if (TRACE>2)
+    printf("          START TIMER: starting timer at %f\n", now());
+ if (f->timer_running) {
+    printf("Warning: attempt to start a timer that is already started\n");
+    return;
+    }
+ f->timer_running = 1;
+ f->timer_due = now() + increment;
+}
+
+/* the shim: lose or corrupt the packet as the simulator's channel would, */
+/* then write it into the next free slot of the outgoing ring             */
+void tolayer3(int AorB,struct pkt packet)
+{
+ struct ring *r = &seg->to[1-me];
+ struct wire_pkt *w;
+ float x;
+
+ if (AorB == A) {
+    A_transport += 1;
+    flows[cur_flow].A_transport += 1;
+    }
+
+ if (jimsrand() < lossprob) {
+    nlost++;
+    if (TRACE>0)
+       printf("          TOLAYER3: packet being lost\n");
+    return;
+    }
+ if (jimsrand() < corruptprob) {
+    ncorrupt++;
+    if ((x = jimsrand()) < .75)
+       packet.payload[0] = 'Z';   /* corrupt payload */
+      else if (x < .875)
+       packet.seqnum = 999999;
+      else
+       packet.acknum = 999999;
+    if (TRACE>0)
+       printf("          TOLAYER3: packet being corrupted\n");
+    }
+
+ if (out_head - r->tail.load(std::memory_order_acquire) == RING_SLOTS) {
+    publish();                 /* let the other side catch up next time */
+    nring_dropped++;
+    return;
+    }
+ w = &r->slots[out_head % RING_SLOTS];
+ w->flow = cur_flow;
+ w->packet = packet;
+ out_head++;
+ npublished++;
+}
+
+void tolayer3_batch(int AorB,struct pkt *packets,int count)
+{
+ int i;
+
+ for (i=0; i<count; i++)
+    tolayer3(AorB, packets[i]);
+}
+
+void tolayer5(int AorB,char *datasent)
+{
+  struct shared_flow *sf = &shared_flows[cur_flow];
+  char expected[20];
+  int i, n;
+
+  if (TRACE>2) {
+     printf("          TOLAYER5: data received: ");
+     for (i=0; i<20; i++)
+        printf("%c",datasent[i]);
+     printf("\n");
+   }
+
+  /* every message is 20 copies of the letter A accepted it with; */
+  /* B can not see how many A has accepted, so there is no check   */
+  /* for a non-existent message                                    */
+  n = sf->B_application.load(std::memory_order_relaxed);
+  memset(expected, *flow_letter(cur_flow, n), 20);
+  check_delivery(expected, datasent);
+
+  if (AorB == 1) {
+     B_application += 1;
+     sf->B_application.store(n + 1, std::memory_order_relaxed);
+     seg->B_application.fetch_add(1, std::memory_order_relaxed);
+     }
+}
+
+void tolayer5_batch(int AorB, struct msg *msgs, int count)
+{
+  int i;
+  for (i=0; i<count; i++)
+     tolayer5(AorB, msgs[i].data);
+}
+
+/* called by A when its send buffer fills up (full = 1) or has room again */
+void layer5_backpressure(int AorB, int full)
+{
+  struct local_flow *f = &flows[cur_flow];
+
+  if (AorB == A && sender_backpressure(&f->bp, full, now())) {
+     nblocked--;
+     f->arrival_armed = 1;
+     f->arrival_due = now();
+     }
+}
+
+/* a real path has no -L to take its round trip from */
+double gettimeout(double dflt, int inflight)
+{
+    return dflt;
+}
+
+double get_sim_time()
+{
+    return now();
+}
+
+int getflow()
+{
+    return cur_flow;
+}
+
+/* checkpoints are a simulator feature; nothing is saved here */
+void checkpoint_io(void *data, int len)
+{
+}
+
+int checkpoint_saving()
+{
+    return 0;
+}
@@ -3,8 +3,40 @@
 #include <getopt.h>
 #include <ctype.h>
 #include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <pthread.h>
 
 #include "../include/simulator.h"
+#include "../include/profile.h"
+#include "../include/frontend.h"
+#include "../include/wire.h"
+#include "../include/ring_buffer.h"
+
+/* Simulated time is kept as a 64-bit count of ticks so that event     */
+/* ordering and timer arithmetic stay exact however long a run gets.   */
+/* It is converted to time units only at the edges: the student API,   */
+/* command line parameters and printed results.                        */
+typedef long long simtime;
+#define  TICKS_PER_UNIT  1048576LL   /* 2^20 ticks per time unit */
+
+simtime to_ticks(double units)
+{
+  return llround(units * TICKS_PER_UNIT);
+}
+
+double to_units(simtime ticks)
+{
+  return (double)ticks / TICKS_PER_UNIT;
+}
 
 /* Statistics */
 int A_application = 0;
@@ -12,15 +44,143 @@ int A_transport = 0;
 int B_application = 0;
 int B_transport = 0;
 
-int win_size;
+int wire_format = WIRE_RAW;  /* packet encoding on the wire, see wire.h */
+int wire_report = 0;       /* -W given: report bytes on the wire */
+float base_timeout = 0;    /* protocols' base timeout, 0 = their own, see -T */
+
+/* Sender buffer back-pressure, see frontend.h */
+float stall_deadline = 5000;  /* end a run whose arrival has been held back this long */
+int stalled_flow = -1;     /* flow that ran into stall_deadline, -1 if none */
+
+/* Checkpointing */
+#define  CKPT_MAGIC      "RTPCKPTA"
+char *ckpt_file = NULL;    /* where to write checkpoints */
+float ckpt_interval = 0;   /* simulated time between checkpoints, 0 = never */
+simtime next_ckpt;         /* time of the next checkpoint */
+char *resume_file = NULL;  /* checkpoint to resume from */
+FILE *ckpt_fp = NULL;      /* checkpoint being written or read */
+int ckpt_saving = 0;       /* 1 while writing, 0 while reading */
+char rng_state[128];       /* state array behind rand(), see initstate(3) */
+
+/* Channel record/replay */
+#define  CHAN_MAGIC      "RTPCHAN1"
+#define  CHAN_LOST       0x80   /* record flag: packet lost, no delay follows */
+#define  CHAN_LINK       0x40   /* record flag: a -L link's loss draw, nothing follows */
+char *record_file = NULL;  /* write every channel decision here */
+char *replay_file = NULL;  /* take channel decisions from here */
+FILE *record_fp = NULL;
+const unsigned char *replay_base = NULL;   /* mmap'd replay file */
+long replay_len;           /* bytes of decisions after the header */
+long replay_pos = 0;       /* offset of the next packet decision */
+long replay_link_pos = 0;  /* offset of the next link decision */
+
+/* what the medium does to one packet */
+struct channel_decision {
+   int lost;
+   float delay;            /* 1..10 time units after the last arrival */
+   int corrupt;            /* 0 none, 1 payload, 2 seqnum, 3 acknum */
+};
+
+/* Early stopping: batch means over consecutive deliveries at B */
+#define  MIN_BATCHES     10     /* batches needed before trusting an interval */
+float target_precision = 0;  /* stop once both CIs are this tight, 0 = off */
+int batch_size = 100;      /* deliveries per batch */
+int batch_fill = 0;        /* deliveries in the current batch */
+simtime batch_start = 0;   /* time the current batch started */
+double batch_latency = 0;  /* latency summed over the current batch */
+int warmup_done = 0;       /* first batch is discarded as warm-up */
+int nbatches = 0;          /* batches accumulated below */
+double tput_sum = 0, tput_sumsq = 0;
+double lat_sum = 0, lat_sumsq = 0;
+int precision_reached = 0;
+
+/* Drain mode: after the last message, run until everything is delivered */
+float drain_deadline = 0;  /* how long to keep draining, 0 = stop at once */
+int draining = 0;          /* no more messages, waiting for deliveries */
+simtime last_msg_time = 0; /* time the last message left layer5 at A */
+simtime last_delivery = 0; /* time of the latest delivery at B */
+int drain_delivered = 0;   /* B_application when the last message was sent */
+
+/* Layer5 arrival processes, see -a. Gaps and dwell times are in time units */
+#define  ARR_UNIFORM     0   /* uniform on [0,2*lambda], the original */
+#define  ARR_POISSON     1   /* exponential gaps of mean lambda */
+#define  ARR_CBR         2   /* one message every lambda */
+#define  ARR_MMPP        3   /* two state Markov modulated Poisson; on/off is one */
+#define  ARR_REPLAY      4   /* arrival times read from a file */
+struct arrival_process {
+   int kind;
+   double gap[2];          /* MMPP: mean gap in each state, 0 = no arrivals */
+   double dwell[2];        /* MMPP: mean time spent in each state */
+   simtime *times;         /* REPLAY: arrival times, ascending */
+   int ntimes;
+};
+struct arrival_spec {      /* one -a option */
+   int first, last;        /* flows it applies to, -1 = all */
+   struct arrival_process proc;
+};
+struct arrival_spec *arrival_specs = NULL;
+int narrival_specs = 0, arrival_speccap = 0;
+char **arrival_args = NULL;   /* -a options, parsed once -t is known */
+int narrival_args = 0, arrival_argcap = 0;
+struct arrival_process uniform_arrivals = { ARR_UNIFORM };
+
+thread_local int cur_flow = 0;  /* flow whose event is being handled */
+unsigned long long channel_stream;   /* channel's random stream, see streamrand() */
+
+/* Live metrics, see -M */
+#define  METRICS_CHECK   1024   /* events between looks at the wall clock */
+char *metrics_path = NULL;   /* file rewritten with each snapshot, or unix:PATH */
+float metrics_interval = 1;  /* wall-clock seconds between snapshots */
+long long nevents = 0;       /* events handled so far */
+double next_metrics;         /* wall-clock time of the next snapshot */
+double last_metrics_wall;    /* wall-clock time and event count of the last one */
+long long last_metrics_events;
+char *metrics_text = NULL;   /* latest snapshot, for socket readers */
+pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+int metrics_fd = -1;         /* listening socket for unix:PATH */
+
+/* Multi-hop path, see -L. A packet crosses links 0..nlinks-1 in turn */
+/* from A to B, in reverse from B to A, each direction of a link       */
+/* being a FIFO queue in front of a transmitter and a delay line;      */
+/* between two links a router stores and forwards it.                  */
+#define  MAXLINKS        16
+struct link {
+   double delay;           /* propagation delay in time units */
+   float loss;             /* probability a packet is lost on the link */
+   double bandwidth;       /* bytes per time unit, 0 = unlimited */
+   int queue;              /* packets it holds, in transmission included; 0 = unlimited */
+   ring_buffer<simtime> sending[2];  /* per direction (0 = towards B): finish times of queued packets */
+   simtime busy_until[2];  /* when the transmitter finishes what it holds */
+   simtime last_arrival[2];  /* latest arrival at the far end */
+   int nforwarded[2], nlost[2], nfull[2], queue_max[2];
+};
+struct link links[MAXLINKS];
+int nlinks = 0;
+
+/* Parallel engine */
+int nthreads = 0;          /* worker threads, 0 = sequential engine */
+struct partition;
+thread_local struct partition *cur_part = NULL;  /* partition this thread runs, NULL when sequential */
+
+void save_checkpoint();
+void schedule_checkpoint();
+void begin_resume();
+void open_channel_trace();
+double batch_mean(double sum);
+double batch_halfwidth(double sum, double sumsq);
+void finish_resume();
+void parse_arrivals();
+void start_metrics();
+void check_metrics(struct flow_counters *committed);
+void publish_metrics(struct flow_counters *committed);
+void stop_metrics();
+void run_parallel();
+struct event *channel_arrival(int AorB,struct pkt packet);
+int link_forward(struct event *ev);
+void add_link(char *arg);
 
-int TRACE = 1;             /* for my debugging */
 int nsim = 0;              /* number of messages from 5 to 4 so far */
-int nsimmax = 0;           /* number of msgs to generate, then stop */
-float time_local = 0;
-float lossprob;            /* probability that a packet is dropped  */
-float corruptprob;         /* probability that one bit is packet is flipped */
-float lambda;              /* arrival rate of messages from layer 5 */
+thread_local simtime time_local = 0;
 int   ntolayer3;           /* number sent into layer 3 */
 int   nlost;               /* number lost in media */
 int ncorrupt;              /* number corrupted by media*/
@@ -38,6 +198,22 @@ float jimsrand()
   return(x);
 }
 
+/* With several flows, each flow's arrivals draw from a stream of their */
+/* own (splitmix64), so what a flow draws does not depend on how its    */
+/* events interleave with other flows'. This is what lets the parallel  */
+/* engine reproduce a sequential run exactly. A single flow's arrivals  */
+/* keep using jimsrand() as before. The channel always has its own      */
+/* stream, so a replayed channel (-P), which draws nothing, leaves the  */
+/* arrivals as they were in the recorded run.                           */
+float streamrand(unsigned long long *stream)
+{
+  unsigned long long z = (*stream += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  z ^= z >> 31;
+  return (z >> 33) / 2147483647.0;   /* same range as jimsrand() */
+}
+
 
 /*****************************************************************
 ***************** NETWORK EMULATION CODE IS BELOW ***********
@@ -61,6 +237,7 @@ to, and you defeinitely should not have to modify
 #define  TIMER_INTERRUPT 0
 #define  FROM_LAYER5     1
 #define  FROM_LAYER3     2
+#define  TO_LINK         3   /* a packet reaches the next link of its path, see -L */
 
 #define  OFF             0
 #define  ON              1
@@ -69,85 +246,361 @@ to, and you defeinitely should not have to modify
 
 
 struct event {
-   float evtime;           /* event time */
+   simtime evtime;         /* event time */
+   long long evseq;        /* insertion order in its flow, the later event wins a tie */
    int evtype;             /* event type code */
    int eventity;           /* entity where event occurs */
+   int eventflow;          /* flow the event belongs to */
+   int cancelled;          /* stopped timer, discarded when it comes up */
    struct pkt *pktptr;     /* ptr to packet (if any) assoc w/ this event */
-   struct event *prev;
-   struct event *next;
+   int evhop;              /* TO_LINK: links the packet has crossed */
  };
-struct event *evlist = NULL;   /* the event list */
 
-/* msg_track */
+/* the event list is a binary heap ordered by time, so scheduling stays */
+/* O(log n) however many flows have events pending                      */
+struct event_queue {
+   struct event **heap;
+   int n, cap;
+};
+struct event_queue main_queue;
+thread_local struct event_queue *evq = &main_queue;  /* queue this thread schedules into */
+simtime lastarrival[2];        /* latest packet arrival scheduled at A and B */
+
+/* msg_track: a flow's messages cur_msg_recv-1 .. cur_msg_sent-1 are kept */
+/* in a circular table that doubles whenever it fills up                  */
+#define  TRACK_MIN       64     /* initial table size */
 struct msg_track {
   char msg_chars[20];
   int delivered;
-}application_msgs[1000];
-int cur_msg_sent = 0, cur_msg_recv = 0;
+  simtime sent_time;        /* when layer5 handed it to A */
+};
+
+/* everything the simulator keeps for one sender/receiver pair */
+struct flow_state {
+  int A_application, A_transport, B_application, B_transport;
+  struct msg_track *application_msgs;
+  int msgs_cap;
+  int cur_msg_sent, cur_msg_recv;
+  struct backpressure bp;   /* A's buffer as layer5 sees it */
+  simtime blocked_since;    /* when the arrival was held back */
+  int stalled;              /* held back past stall_deadline, ends the run */
+  int ndropped_l5;          /* messages dropped by back-pressure */
+  simtime last_delivery;    /* time of the latest delivery at B */
+  int nsim;                 /* messages from layer5 so far */
+  struct event *timer[2];   /* running timer of A and B, or NULL */
+  long long evseq;          /* next insertion number */
+  unsigned long long stream;  /* arrival stream, see streamrand() */
+  struct arrival_process *arrival;  /* layer5 arrival process, see -a */
+  int arr_state;            /* MMPP state, 1 or 2; 0 before the first arrival */
+  simtime arr_switch;       /* when the MMPP leaves its state */
+  int arr_next;             /* next replayed arrival time */
+  simtime latency_sum;      /* layer5 at A to layer5 at B, over deliveries */
+  simtime latency_max;
+  long long backlog_sum;    /* messages held by A as each one arrived */
+  int backlog_max;
+  long long wire_bytes[2];  /* bytes A and B put on the wire, see -W */
+};
+struct flow_state *flows = NULL;
+
+struct msg_track *track(struct flow_state *f, int n)
+{
+  return &f->application_msgs[n % f->msgs_cap];
+}
 
+/* make sure there is room to track one more message */
+void track_reserve(struct flow_state *f, int extra)
+{
+  struct msg_track *newtab;
+  int newcap, n, oldest;
+
+  oldest = f->cur_msg_recv > 0 ? f->cur_msg_recv - 1 : 0;
+  if (f->cur_msg_sent - oldest + extra <= f->msgs_cap)
+     return;
+  newcap = f->msgs_cap > 0 ? f->msgs_cap : TRACK_MIN;
+  while (f->cur_msg_sent - oldest + extra > newcap)
+     newcap *= 2;
+  newtab = (struct msg_track *)malloc(newcap * sizeof(struct msg_track));
+  for (n = oldest; n < f->cur_msg_sent; n++)
+     newtab[n % newcap] = *track(f, n);
+  free(f->application_msgs);
+  f->application_msgs = newtab;
+  f->msgs_cap = newcap;
+}
 
-void insertevent(struct event *p)
+void init_flows()
 {
-   struct event *q,*qold;
+  struct arrival_spec *as;
+  int i;
 
-   if (TRACE>2) {
-      printf("            INSERTEVENT: time is %lf\n",time_local);
-      printf("            INSERTEVENT: future time will be %lf\n",p->evtime);
-      }
-   q = evlist;     /* q points to header of list in which p struct inserted */
-   if (q==NULL) {   /* list is empty */
-        evlist=p;
-        p->next=NULL;
-        p->prev=NULL;
+  flows = (struct flow_state *)calloc(nflows, sizeof(struct flow_state));
+  for (i=0; i<nflows; i++)
+     flows[i].arrival = &uniform_arrivals;
+  /* a later -a overrides an earlier one */
+  for (as = arrival_specs; as < arrival_specs + narrival_specs; as++) {
+     if (as->last >= nflows) {
+        fprintf(stderr, "-a names flow %d, there are only %d\n", as->last, nflows);
+        exit(-1);
         }
-     else {
-        for (qold = q; q !=NULL && p->evtime > q->evtime; q=q->next)
-              qold=q;
-        if (q==NULL) {   /* end of list */
-             qold->next = p;
-             p->prev = qold;
-             p->next = NULL;
-             }
-           else if (q==evlist) { /* front of list */
-             p->next=evlist;
-             p->prev=NULL;
-             p->next->prev=p;
-             evlist = p;
-             }
-           else {     /* middle of list */
-             p->next=q;
-             p->prev=q->prev;
-             q->prev->next=p;
-             q->prev=p;
-             }
-         }
+     for (i=0; i<nflows; i++)
+        if (as->first < 0 || (i >= as->first && i <= as->last))
+           flows[i].arrival = &as->proc;
+     }
+}
+
+/* With -j, flow f belongs to partition f % npartitions and every      */
+/* partition runs its flows' events on its own thread, one window of   */
+/* simulated time at a time. A packet arrives at least one time unit   */
+/* after the packets already in the channel, so nothing a flow sends   */
+/* during a window can reach another flow before the window is over.   */
+/* The threads only log what their events did; at the end of each      */
+/* window the main thread replays the logs in the order the sequential */
+/* engine would have handled the events, running the shared channel    */
+/* and the global counters there.                                      */
+struct flow_counters {       /* a flow's counters after one of its events */
+  int nsim, A_application, B_transport, B_application, ndropped_l5, A_full, stalled;
+  double full_since, stall_time;
+  simtime last_delivery;
+  simtime latency_sum, latency_max;
+  long long backlog_sum;
+  int backlog_max;
+};
+
+struct event_record {        /* one event handled during a window */
+  simtime evtime;
+  long long evseq;
+  int eventflow;
+  int nsends, ndeliveries;   /* its entries in the partition's sends and latencies */
+  struct flow_counters after;
+};
+
+struct send_record {         /* a packet given to layer 3 during a window */
+  int AorB;
+  long long arrseq;          /* evseq kept for its arrival event */
+  struct pkt packet;
+};
+
+struct partition {
+  struct event_queue queue;
+  struct event_record *events;
+  int nevents, eventcap, ev_pos;
+  struct send_record *sends;
+  int nsends, sendcap, send_pos;
+  double *latencies;
+  int nlatencies, latencycap, lat_pos;
+  pthread_t thread;
+};
+struct partition *partitions = NULL;
+int npartitions = 0;
+simtime window_end;          /* events before this time run in the current window */
+int parallel_done = 0;
+pthread_barrier_t window_start, window_done;
+
+/* make room for one more element at arr[n] */
+void *grow_array(void *arr, int n, int *cap, size_t size)
+{
+  if (n < *cap)
+     return arr;
+  *cap = *cap > 0 ? *cap*2 : 256;
+  return realloc(arr, *cap * size);
+}
+
+
+/* p comes off the heap before q: earlier time first, then lower flow, */
+/* and within a flow the event inserted last, as the original list did */
+int event_before(struct event *p, struct event *q)
+{
+   if (p->evtime != q->evtime)
+      return p->evtime < q->evtime;
+   if (p->eventflow != q->eventflow)
+      return p->eventflow < q->eventflow;
+   return p->evseq > q->evseq;
 }
 
+/* make room for count more events */
+void heap_reserve(struct event_queue *eq, int count)
+{
+   if (eq->n + count <= eq->cap)
+      return;
+   while (eq->cap < eq->n + count)
+      eq->cap = eq->cap > 0 ? eq->cap*2 : 1024;
+   eq->heap = (struct event **)realloc(eq->heap, eq->cap * sizeof(struct event *));
+}
+
+/* move heap[i] up past the parents that come off the heap after it */
+void sift_up(struct event_queue *eq, int i)
+{
+   struct event *p = eq->heap[i];
+   int parent;
+
+   for (; i > 0; i = parent) {
+      parent = (i-1) / 2;
+      if (!event_before(p, eq->heap[parent]))
+         break;
+      eq->heap[i] = eq->heap[parent];
+      }
+   eq->heap[i] = p;
+}
+
+/* move heap[i] down past the children that come off the heap before it */
+void sift_down(struct event_queue *eq, int i)
+{
+   struct event *p = eq->heap[i];
+   int child;
+
+   for (; (child = 2*i+1) < eq->n; i = child) {
+      if (child+1 < eq->n && event_before(eq->heap[child+1], eq->heap[child]))
+         child++;
+      if (!event_before(eq->heap[child], p))
+         break;
+      eq->heap[i] = eq->heap[child];
+      }
+   eq->heap[i] = p;
+}
+
+/* add an event that already has its evseq */
+void heap_push(struct event_queue *eq, struct event *p)
+{
+   heap_reserve(eq, 1);
+   eq->heap[eq->n++] = p;
+   sift_up(eq, eq->n - 1);
+}
+
+/* Restore the heap once events that already have their evseq were     */
+/* stored at heap[from .. n-1], after heap_reserve(). A burst's         */
+/* arrivals are in time order, so each one sifted up in turn mostly     */
+/* stops at its parent.                                                 */
+void heap_fix(struct event_queue *eq, int from)
+{
+   int i;
+
+   for (i = from; i < eq->n; i++)
+      sift_up(eq, i);
+}
+
+/* remove the earliest event from the heap */
+void heap_pop(struct event_queue *eq)
+{
+   if (--eq->n > 0) {
+      eq->heap[0] = eq->heap[eq->n];
+      sift_down(eq, 0);
+      }
+}
+
+/* earliest pending event in eq, or NULL; stopped timers are discarded here */
+struct event *queue_top(struct event_queue *eq)
+{
+   struct event *q;
+
+   while (eq->n > 0 && eq->heap[0]->cancelled) {
+      q = eq->heap[0];
+      heap_pop(eq);
+      free(q);
+      }
+   return eq->n > 0 ? eq->heap[0] : NULL;
+}
 
+struct event *nextevent()
+{
+   return queue_top(evq);
+}
 
+/* number a new event within its flow, see event_before() */
+void stamp_event(struct event *p)
+{
+   if (TRACE>2) {
+      printf("            INSERTEVENT: time is %lf\n",to_units(time_local));
+      printf("            INSERTEVENT: future time will be %lf\n",to_units(p->evtime));
+      }
+   p->evseq = flows[p->eventflow].evseq++;
+   p->cancelled = 0;
+}
 
+void insertevent(struct event *p)
+{
+   PROFILE_SCOPE("insertevent");
+   stamp_event(p);
+   heap_push(evq, p);
+}
 
 /********************* EVENT HANDLINE ROUTINES *******/
 /*  The next set of routines handle the event list   */
 /*****************************************************/
 
-void generate_next_arrival()
+float arrival_rand(int flow)
+{
+   return nflows > 1 ? streamrand(&flows[flow].stream) : jimsrand();
+}
+
+/* exponential with mean m, from the flow's arrival stream */
+double arrival_exp(int flow, double m)
+{
+   float u;
+
+   while ((u = arrival_rand(flow)) >= 1.0)
+      ;
+   return -m*log(1.0 - u);
+}
+
+/* time of the flow's next layer5 arrival, or -1 if it has no more */
+simtime next_arrival_time(int flow)
+{
+   struct flow_state *f = &flows[flow];
+   struct arrival_process *ap = f->arrival;
+   simtime t, next;
+   double x;
+   int s;
+
+   switch (ap->kind) {
+   case ARR_POISSON:
+      return time_local + to_ticks(arrival_exp(flow, lambda));
+   case ARR_CBR:
+      return time_local + to_ticks(lambda);
+   case ARR_REPLAY:
+      /* an arrival held back by back-pressure makes the later ones late */
+      if (f->arr_next >= ap->ntimes)
+         return -1;
+      t = ap->times[f->arr_next++];
+      return t > time_local ? t : time_local;
+   case ARR_MMPP:
+      if (f->arr_state == 0) {
+         f->arr_state = 1;
+         f->arr_switch = time_local + to_ticks(arrival_exp(flow, ap->dwell[0]));
+         }
+      /* gaps are memoryless, so one cut short by a state change */
+      /* starts over at the new state's rate                     */
+      t = time_local;
+      while (1) {
+         s = f->arr_state - 1;
+         if (ap->gap[s] > 0) {
+            next = t + to_ticks(arrival_exp(flow, ap->gap[s]));
+            if (next < f->arr_switch)
+               return next;
+            }
+         t = f->arr_switch;
+         f->arr_state = 3 - f->arr_state;
+         f->arr_switch = t + to_ticks(arrival_exp(flow, ap->dwell[f->arr_state - 1]));
+         }
+   default:
+      x = lambda*arrival_rand(flow)*2;  /* x is uniform on [0,2*lambda] */
+                                /* having mean of lambda        */
+      return time_local + to_ticks(x);
+   }
+}
+
+void generate_next_arrival(int flow)
 {
-   double x,log(),ceil();
    struct event *evptr;
-//    //char *malloc();
-   float ttime;
-   int tempint;
+   simtime t;
 
    if (TRACE>2)
        printf("          GENERATE NEXT ARRIVAL: creating new arrival\n");
 
-   x = lambda*jimsrand()*2;  /* x is uniform on [0,2*lambda] */
-                             /* having mean of lambda        */
-
+   if ((t = next_arrival_time(flow)) < 0)
+      return;
    evptr = (struct event *)malloc(sizeof(struct event));
-   evptr->evtime =  time_local + x;
+   evptr->evtime =  t;
    evptr->evtype =  FROM_LAYER5;
+   evptr->eventflow = flow;
    if (BIDIRECTIONAL && (jimsrand()>0.5) )
       evptr->eventity = B;
     else
@@ -179,7 +632,7 @@ void init(int seed)                         /* initialize the simulator */
    scanf("%d",&TRACE);
    */
 
-   srand(seed);              /* init random number generator */
+   initstate(seed, rng_state, sizeof(rng_state));  /* init random number generator */
    sum = 0.0;                /* test random number generator for students */
    for (i=0; i<1000; i++)
       sum=sum+jimsrand();    /* jimsrand() should be uniform in [0,1] */
@@ -196,7 +649,13 @@ void init(int seed)                         /* initialize the simulator */
    ncorrupt = 0;
 
    time_local=0;                    /* initialize time to 0.0 */
-   generate_next_arrival();     /* initialize event list */
+   lastarrival[A] = lastarrival[B] = 0;
+   init_flows();
+   channel_stream = (unsigned long long)seed << 32;
+   for (i=0; i<nflows; i++)
+      flows[i].stream = channel_stream + i + 1;
+   for (i=0; i<nflows; i++)
+      generate_next_arrival(i);     /* initialize event list */
 }
 
 
@@ -215,110 +674,392 @@ void init(int seed)                         /* initialize the simulator */
 //int   nlost;               /* number lost in media */
 //int ncorrupt;              /* number corrupted by media*/
 
-/**
- * Checks if the array pointed to by input holds a valid number.
- *
- * @param  input char* to the array holding the value.
- * @return TRUE or FALSE
- */
-int isNumber(char *input)
-{
-    while (*input){
-        if (!isdigit(*input))
-            return 0;
-        else
-            input += 1;
-    }
-
-    return 1;
-}
-
-int read_arg_int(char c)
+/* read the arrival times for replay:FILE, one per line in time units */
+void read_arrival_times(struct arrival_process *ap, char *file)
 {
-    if(!isNumber(optarg)) {
-        fprintf(stderr, "Invalid value for -%c\n", c);
+    FILE *fp;
+    double t;
+    int cap = 0;
+
+    if ((fp = fopen(file, "r")) == NULL) {
+        fprintf(stderr, "Unable to open %s\n", file);
+        exit(-1);
+    }
+    while (fscanf(fp, "%lf", &t) == 1) {
+        if (t < 0 || (ap->ntimes > 0 && to_ticks(t) < ap->times[ap->ntimes-1])) {
+            fprintf(stderr, "%s: arrival times must be ascending and not negative\n", file);
+            exit(-1);
+        }
+        ap->times = (simtime *)grow_array(ap->times, ap->ntimes, &cap, sizeof(simtime));
+        ap->times[ap->ntimes++] = to_ticks(t);
+    }
+    if (!feof(fp)) {
+        fprintf(stderr, "%s: not a list of arrival times\n", file);
         exit(-1);
     }
-    return atoi(optarg);
+    fclose(fp);
 }
 
-float read_arg_float(char c)
+/* turn each -a [FLOWS=]PROCESS into an arrival_spec */
+void parse_arrivals()
 {
-    float val = atof(optarg);
-    if(val < 0.0 || val > 1.0){
-        fprintf(stderr, "Invalid value for -%c\n", c);
-        exit(-1);
+    struct arrival_spec *as;
+    struct arrival_process *ap;
+    char *arg, *eq, *end;
+    double on, off;
+    int i;
+
+    for (i=0; i<narrival_args; i++) {
+        arrival_specs = (struct arrival_spec *)grow_array(arrival_specs, narrival_specs, &arrival_speccap, sizeof(struct arrival_spec));
+        as = &arrival_specs[narrival_specs++];
+        memset(as, 0, sizeof(*as));
+        ap = &as->proc;
+        arg = arrival_args[i];
+        as->first = as->last = -1;
+        if ((eq = strchr(arg, '=')) != NULL) {
+            as->first = as->last = strtol(arg, &end, 10);
+            if (*end == '-')
+                as->last = strtol(end+1, &end, 10);
+            if (end == arg || end != eq || as->first < 0 || as->last < as->first) {
+                fprintf(stderr, "Invalid flows for -a: %s\n", arg);
+                exit(-1);
+            }
+            arg = eq+1;
+        }
+
+        if (strcmp(arg, "uniform") == 0)
+            ap->kind = ARR_UNIFORM;
+        else if (strcmp(arg, "poisson") == 0)
+            ap->kind = ARR_POISSON;
+        else if (strcmp(arg, "cbr") == 0)
+            ap->kind = ARR_CBR;
+        else if (sscanf(arg, "onoff:%lf:%lf", &on, &off) == 2 && on > 0 && off > 0) {
+            /* Poisson at the -t rate while on, nothing while off */
+            ap->kind = ARR_MMPP;
+            ap->gap[0] = lambda;
+            ap->gap[1] = 0;
+            ap->dwell[0] = on;
+            ap->dwell[1] = off;
+        }
+        else if (sscanf(arg, "mmpp:%lf:%lf:%lf:%lf", &ap->gap[0], &ap->gap[1], &ap->dwell[0], &ap->dwell[1]) == 4
+                 && ap->gap[0] >= 0 && ap->gap[1] >= 0 && ap->gap[0] + ap->gap[1] > 0
+                 && ap->dwell[0] > 0 && ap->dwell[1] > 0)
+            ap->kind = ARR_MMPP;
+        else if (strncmp(arg, "replay:", 7) == 0) {
+            ap->kind = ARR_REPLAY;
+            read_arrival_times(ap, arg+7);
+        }
+        else {
+            fprintf(stderr, "Invalid arrival process for -a: %s\n", arg);
+            exit(-1);
+        }
     }
-    return val;
 }
 
-void display_usage(char *filename)
+/* the simulator's own options, after the common ones in display_usage() */
+const char usage_more[] =
+    " -S End the run once block has held an arrival back this many time units\n"
+    " -k Checkpoint file -i Checkpoint interval in time units -r Resume from checkpoint file\n"
+    " -R Record channel decisions to file -P Replay channel decisions from file\n"
+    " -z Stop once throughput and latency are known to this relative precision -g Deliveries per batch\n"
+    " -D Drain in flight messages for up to this many time units after the last one is sent\n"
+    " -j Threads to run the flows on\n"
+    " -a Layer5 arrival process of [flows=]: uniform, poisson, cbr, onoff:ON:OFF, mmpp:GAP1:GAP2:DWELL1:DWELL2 or replay:FILE\n"
+    " -L Add a link to the path, DELAY[:LOSS[:BANDWIDTH in bytes/time unit[:QUEUE in packets]]]\n"
+    " -T Base retransmission timeout, by default the protocol's own plus the -L path's round trip\n"
+    " -W Wire encoding of packets, raw, compact or compact16, and report bytes on the wire\n"
+    " -M Write live metrics to this file, or serve them on unix:PATH -I Seconds between metrics snapshots\n";
+
+/* run one event on the current thread; the caller has removed it from */
+/* the event list and set time_local to its time                        */
+void handle_event(struct event *eventptr)
 {
-    printf("Usage:\n %s -s Seed -w Window size -m Number of messages to simulate -l Loss -c Corruption -t Average time between messages from sender's layer5 -v Tracing\n", filename);
+   struct flow_state *f;
+   struct msg  msg2give;
+   struct pkt  pkt2give;
+   int i,j;
+   PROFILE_SCOPE("handle_event");
+
+   cur_flow = eventptr->eventflow;
+   f = &flows[cur_flow];
+   if (f->bp.arrival_blocked && !f->stalled && time_local - f->blocked_since > to_ticks(stall_deadline)) {
+       /* the protocol is not making room - end the run rather than wait forever */
+       f->stalled = 1;
+       if (cur_part == NULL && stalled_flow < 0)
+          stalled_flow = cur_flow;
+       if (TRACE>0)
+          printf("          MAINLOOP: arrival held back for more than %f time units, stopping\n", stall_deadline);
+       }
+   if (eventptr->evtype == FROM_LAYER5 && draining) {
+       /* no new messages while draining */
+       }
+     else if (eventptr->evtype == FROM_LAYER5 && eventptr->eventity == A && f->bp.A_full
+       && bp_policy != BP_DROP) {
+       /* A's buffer is full - hold layer5 back */
+       if (bp_policy == BP_BLOCK) {
+          f->bp.arrival_blocked = 1;   /* layer5_backpressure() resumes arrivals */
+          f->blocked_since = time_local;
+          }
+       else {
+          struct event *retry = (struct event *)malloc(sizeof(struct event));
+          retry->evtime = time_local + to_ticks(lambda);
+          retry->evtype = FROM_LAYER5;
+          retry->eventity = A;
+          retry->eventflow = cur_flow;
+          insertevent(retry);
+       }
+       if (TRACE>0)
+          printf("          MAINLOOP: sender buffer full, arrival held back\n");
+       }
+     else if (eventptr->evtype == FROM_LAYER5 ) {
+       generate_next_arrival(cur_flow);   /* set up future arrival */
+       /* fill in msg to give with string of same letter */
+       j = f->nsim % 26;
+       for (i=0; i<20; i++)
+          msg2give.data[i] = 97 + j;
+       if (TRACE>2) {
+          printf("          MAINLOOP: data given to student: ");
+            for (i=0; i<20; i++)
+             printf("%c", msg2give.data[i]);
+          printf("\n");
+    }
+       f->nsim++;
+       if (cur_part == NULL) {
+          /* a parallel run sums the totals from the flows at the end */
+          nsim++;
+          last_msg_time = time_local;
+          drain_delivered = B_application;
+          }
+       if (eventptr->eventity == A && f->bp.A_full)
+       {
+           /* BP_DROP: A's buffer is full, message is lost at the sender */
+           f->ndropped_l5 += 1;
+           if (TRACE>0)
+              printf("          MAINLOOP: sender buffer full, message dropped\n");
+       }
+       else if (eventptr->eventity == A)
+       {
+           if (cur_part == NULL)
+              A_application += 1;
+           f->A_application += 1;
+           f->backlog_sum += f->A_application - f->B_application;
+           if (f->A_application - f->B_application > f->backlog_max)
+              f->backlog_max = f->A_application - f->B_application;
+
+         track_reserve(f, 1);
+         memcpy(track(f, f->cur_msg_sent)->msg_chars, msg2give.data, 20);
+         track(f, f->cur_msg_sent)->delivered = 0;
+         track(f, f->cur_msg_sent)->sent_time = time_local;
+         f->cur_msg_sent += 1;
+
+         PROFILE_SCOPE("A_output");
+         A_output(msg2give);
+       }
+       /*
+        else
+          B_output(msg2give);
+          */
+       }
+     else if (eventptr->evtype ==  FROM_LAYER3) {
+       pkt2give.seqnum = eventptr->pktptr->seqnum;
+       pkt2give.acknum = eventptr->pktptr->acknum;
+       pkt2give.checksum = eventptr->pktptr->checksum;
+       for (i=0; i<20; i++)
+           pkt2give.payload[i] = eventptr->pktptr->payload[i];
+   if (eventptr->eventity ==A) {    /* deliver packet by calling */
+         PROFILE_SCOPE("A_input");
+         A_input(pkt2give);            /* appropriate entity */
+       }
+       else
+       {
+           if (cur_part == NULL)
+              B_transport += 1;
+           f->B_transport += 1;
+           PROFILE_SCOPE("B_input");
+           B_input(pkt2give);
+       }
+   free(eventptr->pktptr);          /* free the memory for packet */
+       }
+     else if (eventptr->evtype ==  TO_LINK) {
+       /* a router passes the packet to its next link */
+       if (link_forward(eventptr)) {
+          insertevent(eventptr);
+          return;
+          }
+       free(eventptr->pktptr);
+       }
+     else if (eventptr->evtype ==  TIMER_INTERRUPT) {
+       f->timer[eventptr->eventity] = NULL;
+       if (eventptr->eventity == A) {
+      PROFILE_SCOPE("A_timerinterrupt");
+      A_timerinterrupt();
+      }
+        else {
+      PROFILE_SCOPE("B_timerinterrupt");
+      B_timerinterrupt();
+      }
+        }
+     else  {
+    printf("INTERNAL PANIC: unknown event type \n");
+        }
+   free(eventptr);
 }
 
 int main(int argc, char **argv)
 {
    struct event *eventptr;
-   struct msg  msg2give;
-   struct pkt  pkt2give;
-
-   int i,j;
+   struct flow_state *f;
+
+   int i;
+   double tput, tput_sum_f, tput_sumsq_f;
+   double stall_total;
+   simtime latency_total, latency_max;
+   long long backlog_total;
+   long long wire_total[2];
+   int dropped_total, backlog_max;
    char c;
 
    int opt;
-   int seed;
+   char seen[128];
 
-   //Check for number of arguments
-   if(argc != 15){
-           fprintf(stderr, "Missing arguments!\n");
-        display_usage(argv[0]);
-        return -1;
-   }
+   memset(seen, 0, sizeof(seen));
 
    /*
     * Parse the arguments
     * http://www.gnu.org/software/libc/manual/html_node/Example-of-Getopt.html
     */
-    while((opt = getopt(argc, argv,"s:w:m:l:c:t:v:")) != -1){
+    while((opt = getopt(argc, argv, COMMON_OPTIONS "S:k:i:r:R:P:z:g:D:j:a:W:L:M:I:T:")) != -1){
+        seen[(unsigned char)opt] = 1;
+        if (read_common_option(opt))
+            continue;
         switch (opt){
-            case 's':   seed = read_arg_int(opt);
+            case 'S':     if((stall_deadline = atof(optarg)) <= 0.0){
+                            fprintf(stderr, "Invalid value for -%c\n", opt);
+                            exit(-1);
+                        }
+                        break;
+            case 'k':     ckpt_file = optarg;
+                        break;
+            case 'i':     if((ckpt_interval = atof(optarg)) <= 0.0){
+                            fprintf(stderr, "Invalid value for -%c\n", opt);
+                            exit(-1);
+                        }
+                        break;
+            case 'r':     resume_file = optarg;
+                        break;
+            case 'R':     record_file = optarg;
+                        break;
+            case 'P':     replay_file = optarg;
+                        break;
+            case 'z':     if((target_precision = atof(optarg)) <= 0.0){
+                            fprintf(stderr, "Invalid value for -%c\n", opt);
+                            exit(-1);
+                        }
+                        break;
+            case 'D':     if((drain_deadline = atof(optarg)) <= 0.0){
+                            fprintf(stderr, "Invalid value for -%c\n", opt);
+                            exit(-1);
+                        }
                         break;
-            case 'w':   win_size = read_arg_int(opt);
+            case 'g':     if((batch_size = read_arg_int(opt)) <= 1){
+                            fprintf(stderr, "Invalid value for -%c\n", opt);
+                            exit(-1);
+                        }
                         break;
-            case 'm':     nsimmax = read_arg_int(opt);
+            case 'j':     if((nthreads = read_arg_int(opt)) <= 0){
+                            fprintf(stderr, "Invalid value for -%c\n", opt);
+                            exit(-1);
+                        }
                         break;
-            case 'l':     lossprob = read_arg_float(opt);
+            case 'a':     arrival_args = (char **)grow_array(arrival_args, narrival_args, &arrival_argcap, sizeof(char *));
+                        arrival_args[narrival_args++] = optarg;
                         break;
-            case 'c':     corruptprob = read_arg_float(opt);
+            case 'W':     if((wire_format = wire_format_parse(optarg)) < 0){
+                            fprintf(stderr, "Invalid value for -%c\n", opt);
+                            exit(-1);
+                        }
+                        wire_report = 1;
                         break;
-            case 't':     if((lambda = atof(optarg)) <= 0.0){
+            case 'L':     add_link(optarg);
+                        break;
+            case 'T':     if((base_timeout = atof(optarg)) <= 0.0){
                             fprintf(stderr, "Invalid value for -%c\n", opt);
                             exit(-1);
                         }
                         break;
-            case 'v':     TRACE = read_arg_int(opt);
+            case 'M':     metrics_path = optarg;
+                        break;
+            case 'I':     if((metrics_interval = atof(optarg)) <= 0.0){
+                            fprintf(stderr, "Invalid value for -%c\n", opt);
+                            exit(-1);
+                        }
                         break;
             case '?':
                default:    fprintf(stderr, "Invalid arguments!\n");
-                        display_usage(argv[0]);
+                        display_usage(argv[0], usage_more);
                         return -1;
        }
     }
 
-   init(seed);
+   /* -s and -w come from the checkpoint when resuming */
+   if (missing_args(seen, resume_file != NULL ? "mlctv" : "swmlctv")) {
+        fprintf(stderr, "Missing arguments!\n");
+        display_usage(argv[0], usage_more);
+        return -1;
+   }
+
+   if (ckpt_file != NULL && ckpt_interval <= 0) {
+        fprintf(stderr, "-k needs a checkpoint interval (-i)\n");
+        return -1;
+   }
+
+   if (record_file != NULL && replay_file != NULL) {
+        fprintf(stderr, "-R and -P can not be used together\n");
+        return -1;
+   }
+
+   if (nthreads > 0 && (ckpt_file != NULL || resume_file != NULL || drain_deadline > 0 || TRACE > 0)) {
+        fprintf(stderr, "-j can not be used with -k, -r, -D or tracing (-v above 0)\n");
+        return -1;
+   }
+
+   if (nthreads > 0 && nlinks > 0) {
+        fprintf(stderr, "-j can not be used with -L, the links are shared by all flows\n");
+        return -1;
+   }
+   open_channel_trace();
+   parse_arrivals();
+
+   if (resume_file != NULL)
+      begin_resume();
+    else
+      init(seed);
    A_init();
    B_init();
+   if (resume_file != NULL)
+      finish_resume();
+   if (ckpt_file != NULL)
+      schedule_checkpoint();
+   if (metrics_path != NULL)
+      start_metrics();
+   if (nthreads > 0 && nflows > 1) {
+      run_parallel();
+      goto terminate;
+      }
 
    while (1) {
-        eventptr = evlist;            /* get next event to simulate */
+        eventptr = nextevent();       /* get next event to simulate */
+        if (ckpt_file != NULL && eventptr != NULL && eventptr->evtime >= next_ckpt) {
+           save_checkpoint();        /* state as of just before this event */
+           schedule_checkpoint();
+           }
         if (eventptr==NULL)
            goto terminate;
-        evlist = evlist->next;        /* remove this event from event list */
-        if (evlist!=NULL)
-           evlist->prev=NULL;
+        heap_pop(evq);                /* remove this event from event list */
+        if (metrics_path != NULL && (++nevents % METRICS_CHECK) == 0)
+           check_metrics(NULL);
         if (TRACE>=2) {
-           printf("\nEVENT time: %f,",eventptr->evtime);
+           printf("\nEVENT time: %f,",to_units(eventptr->evtime));
            printf("  type: %d",eventptr->evtype);
            if (eventptr->evtype==0)
            printf(", timerinterrupt  ");
@@ -326,79 +1067,130 @@ int main(int argc, char **argv)
                printf(", fromlayer5 ");
              else
          printf(", fromlayer3 ");
-           printf(" entity: %d\n",eventptr->eventity);
+           printf(" entity: %d",eventptr->eventity);
+           if (nflows > 1)
+              printf(" flow: %d",eventptr->eventflow);
+           printf("\n");
            }
         time_local = eventptr->evtime;        /* update time to next event time */
-        if (nsim==nsimmax)
+        if ((nsim==nsimmax || precision_reached || stalled_flow >= 0) && !draining) {
+           if (drain_deadline <= 0)
       break;                        /* all done with simulation */
-        if (eventptr->evtype == FROM_LAYER5 ) {
-            generate_next_arrival();   /* set up future arrival */
-            /* fill in msg to give with string of same letter */
-            j = nsim % 26;
-            for (i=0; i<20; i++)
-               msg2give.data[i] = 97 + j;
-            if (TRACE>2) {
-               printf("          MAINLOOP: data given to student: ");
-                 for (i=0; i<20; i++)
-                  printf("%c", msg2give.data[i]);
-               printf("\n");
-         }
-            nsim++;
-            if (eventptr->eventity == A)
-            {
-                A_application += 1;
-
-              memcpy(application_msgs[cur_msg_sent].msg_chars, msg2give.data, 20);
-              application_msgs[cur_msg_sent].delivered = 0;
-              cur_msg_sent += 1;
-
-              A_output(msg2give);
-            }
-            /*
-             else
-               B_output(msg2give);
-               */
-            }
-          else if (eventptr->evtype ==  FROM_LAYER3) {
-            pkt2give.seqnum = eventptr->pktptr->seqnum;
-            pkt2give.acknum = eventptr->pktptr->acknum;
-            pkt2give.checksum = eventptr->pktptr->checksum;
-            for (i=0; i<20; i++)
-                pkt2give.payload[i] = eventptr->pktptr->payload[i];
-        if (eventptr->eventity ==A)      /* deliver packet by calling */
-              A_input(pkt2give);            /* appropriate entity */
-            else
-            {
-                B_transport += 1;
-                B_input(pkt2give);
-            }
-        free(eventptr->pktptr);          /* free the memory for packet */
-            }
-          else if (eventptr->evtype ==  TIMER_INTERRUPT) {
-            if (eventptr->eventity == A)
-           A_timerinterrupt();
-               /*
-             else
-           B_timerinterrupt();
-               */
-             }
-          else  {
-         printf("INTERNAL PANIC: unknown event type \n");
-             }
-        free(eventptr);
+           draining = 1;              /* stop arrivals, let the rest be delivered */
+           if (TRACE>0)
+              printf("          MAINLOOP: last message sent at %f, draining\n", to_units(last_msg_time));
+           }
+        if (draining && time_local > last_msg_time + to_ticks(drain_deadline))
+           break;                     /* drain deadline passed */
+        handle_event(eventptr);
+        if (draining && B_application == A_application)
+           goto terminate;            /* every message has been delivered */
         }
 
 terminate:
+   if (record_fp != NULL)
+      fclose(record_fp);
+   if (metrics_path != NULL)
+      stop_metrics();
    //Do NOT change any of the following printfs
-   printf(" Simulator terminated at time %f\n after sending %d msgs from layer5\n",time_local,nsim);
+   printf(" Simulator terminated at time %f\n after sending %d msgs from layer5\n",to_units(time_local),nsim);
 
    printf("\n");
    printf("[PA2]%d packets sent from the Application Layer of Sender A[/PA2]\n", A_application);
    printf("[PA2]%d packets sent from the Transport Layer of Sender A[/PA2]\n", A_transport);
    printf("[PA2]%d packets received at the Transport layer of Receiver B[/PA2]\n", B_transport);
    printf("[PA2]%d packets received at the Application layer of Receiver B[/PA2]\n", B_application);
-   printf("[PA2]Total time: %f time units[/PA2]\n", time_local);
-   printf("[PA2]Throughput: %f packets/time units[/PA2]\n", B_application/time_local);
+   printf("[PA2]Total time: %f time units[/PA2]\n", to_units(time_local));
+   printf("[PA2]Throughput: %f packets/time units[/PA2]\n", B_application/to_units(time_local));
+
+   stall_total = 0;
+   dropped_total = 0;
+   for (i=0; i<nflows; i++) {
+      flows[i].bp.stall_time = sender_stall(&flows[i].bp, to_units(time_local));
+      stall_total += flows[i].bp.stall_time;
+      dropped_total += flows[i].ndropped_l5;
+      }
+   printf("[PA2]%d messages dropped by sender back-pressure[/PA2]\n", dropped_total);
+   printf("[PA2]Sender stall time: %f time units[/PA2]\n", stall_total);
+   if (stalled_flow >= 0)
+      printf("[PA2]Run ended early: flow %d held an arrival back for more than %f time units (-S)[/PA2]\n",
+             stalled_flow, stall_deadline);
+   if (drain_deadline > 0) {
+      printf("[PA2]Flow completion time: %f time units%s[/PA2]\n", to_units(last_delivery),
+             B_application == A_application ? "" : " (drain deadline passed)");
+      printf("[PA2]Goodput: %f packets/time units[/PA2]\n",
+             last_delivery > 0 ? B_application/to_units(last_delivery) : 0);
+      printf("[PA2]Tail: %d packets delivered in %f time units after the last message[/PA2]\n",
+             B_application - drain_delivered, to_units(last_delivery - last_msg_time));
+      printf("[PA2]Tail goodput: %f packets/time units[/PA2]\n",
+             last_delivery > last_msg_time ? (B_application - drain_delivered)/to_units(last_delivery - last_msg_time) : 0);
+   }
+   if (target_precision > 0) {
+      printf("[PA2]Throughput 95%% CI: %f +/- %f packets/time units over %d batches[/PA2]\n",
+             batch_mean(tput_sum), batch_halfwidth(tput_sum, tput_sumsq), nbatches);
+      printf("[PA2]Mean latency 95%% CI: %f +/- %f time units[/PA2]\n",
+             batch_mean(lat_sum), batch_halfwidth(lat_sum, lat_sumsq));
+      printf("[PA2]Target precision %s[/PA2]\n", precision_reached ? "reached" : "not reached");
+   }
+   if (narrival_specs > 0) {
+      latency_total = latency_max = 0;
+      backlog_total = 0;
+      backlog_max = 0;
+      for (i=0; i<nflows; i++) {
+         latency_total += flows[i].latency_sum;
+         if (flows[i].latency_max > latency_max)
+            latency_max = flows[i].latency_max;
+         backlog_total += flows[i].backlog_sum;
+         if (flows[i].backlog_max > backlog_max)
+            backlog_max = flows[i].backlog_max;
+         }
+      printf("[PA2]Latency: mean %f, max %f time units[/PA2]\n",
+             B_application > 0 ? to_units(latency_total)/B_application : 0, to_units(latency_max));
+      printf("[PA2]Sender backlog at arrivals: mean %f, max %d messages[/PA2]\n",
+             A_application > 0 ? (double)backlog_total/A_application : 0, backlog_max);
+   }
+   if (wire_report) {
+      wire_total[A] = wire_total[B] = 0;
+      for (i=0; i<nflows; i++) {
+         wire_total[A] += flows[i].wire_bytes[A];
+         wire_total[B] += flows[i].wire_bytes[B];
+         }
+      printf("[PA2]Bytes on the wire (%s): %lld from A, %lld from B, %f per packet[/PA2]\n",
+             wire_format_name(wire_format), wire_total[A], wire_total[B],
+             ntolayer3 > 0 ? (double)(wire_total[A] + wire_total[B])/ntolayer3 : 0);
+      printf("[PA2]Byte goodput: %f payload bytes/time units, %f%% of the bytes on the wire are overhead[/PA2]\n",
+             B_application*20.0/to_units(time_local),
+             wire_total[A] + wire_total[B] > 0 ? 100.0 - 100.0*B_application*20/(wire_total[A] + wire_total[B]) : 0);
+   }
+   for (i=0; i<nlinks; i++)
+      printf("[PA2]Link %d: %d packets forwarded towards B and %d towards A, %d lost, %d dropped at a full queue, at most %d queued[/PA2]\n",
+             i, links[i].nforwarded[0], links[i].nforwarded[1], links[i].nlost[0] + links[i].nlost[1],
+             links[i].nfull[0] + links[i].nfull[1],
+             links[i].queue_max[0] > links[i].queue_max[1] ? links[i].queue_max[0] : links[i].queue_max[1]);
+   if (nflows > 1) {
+      tput_sum_f = tput_sumsq_f = 0;
+      for (i=0; i<nflows; i++) {
+         f = &flows[i];
+         tput = f->B_application/to_units(time_local);
+         tput_sum_f += tput;
+         tput_sumsq_f += tput*tput;
+         printf("[PA2]Flow %d: %d sent, %d delivered, %d transport packets from A, %d at B, %f packets/time units",
+                i, f->A_application, f->B_application, f->A_transport, f->B_transport, tput);
+         if (f->ndropped_l5 > 0 || f->bp.stall_time > 0)
+            printf(", %d dropped, stalled %f time units", f->ndropped_l5, f->bp.stall_time);
+         if (drain_deadline > 0)
+            printf(", completed at %f", to_units(f->last_delivery));
+         if (narrival_specs > 0)
+            printf(", latency mean %f max %f, backlog mean %f max %d",
+                   f->B_application > 0 ? to_units(f->latency_sum)/f->B_application : 0, to_units(f->latency_max),
+                   f->A_application > 0 ? (double)f->backlog_sum/f->A_application : 0, f->backlog_max);
+         if (wire_report)
+            printf(", %lld bytes on the wire from A, %lld from B", f->wire_bytes[A], f->wire_bytes[B]);
+         printf("[/PA2]\n");
+         }
+      printf("[PA2]Jain fairness index over %d flows: %f[/PA2]\n", nflows,
+             tput_sumsq_f > 0 ? tput_sum_f*tput_sum_f / (nflows*tput_sumsq_f) : 0);
+   }
    return 0;
 }
 
@@ -437,96 +1229,877 @@ void printevlist()
 {
   struct event *q;
   int i;
-  printf("--------------\nEvent List Follows:\n");
-  for(q = evlist; q!=NULL; q=q->next) {
-    printf("Event time: %f, type: %d entity: %d\n",q->evtime,q->evtype,q->eventity);
+  printf("--------------\nEvent List Follows (heap order):\n");
+  for(i = 0; i < evq->n; i++) {
+    q = evq->heap[i];
+    if (!q->cancelled)
+       printf("Event time: %f, type: %d entity: %d flow: %d\n",to_units(q->evtime),q->evtype,q->eventity,q->eventflow);
     }
   printf("--------------\n");
 }
 
 
 
+/************************** EARLY STOPPING ***************/
+/* With -z, deliveries at B are grouped into batches of -g messages.   */
+/* Each batch gives one throughput sample (messages over the batch's   */
+/* duration) and one mean latency sample (layer5 at A to layer5 at B). */
+/* The batch means give Student t confidence intervals, and the run    */
+/* stops once both half widths are within -z of their means.          */
+
+/* two sided 95% Student t quantile, Cornish-Fisher expansion */
+double t975(int df)
+{
+  double z = 1.959964;
+  double z3 = z*z*z, z5 = z3*z*z;
+  return z + (z3 + z)/(4.0*df) + (5*z5 + 16*z3 + 3*z)/(96.0*df*df);
+}
+
+double batch_mean(double sum)
+{
+  return nbatches > 0 ? sum / nbatches : 0;
+}
+
+double batch_halfwidth(double sum, double sumsq)
+{
+  double mean, var;
+
+  if (nbatches < 2)
+     return 0;
+  mean = sum / nbatches;
+  var = (sumsq - nbatches*mean*mean) / (nbatches - 1);
+  if (var < 0)
+     var = 0;
+  return t975(nbatches - 1) * sqrt(var / nbatches);
+}
+
+/* account for one message delivered at B after latency time units */
+void record_delivery(double latency)
+{
+  double tput, lat;
+
+  if (batch_fill == 0 && !warmup_done && nbatches == 0)
+     batch_start = time_local;
+  batch_fill++;
+  batch_latency += latency;
+  if (batch_fill < batch_size)
+     return;
+
+  if (warmup_done && time_local > batch_start) {
+     tput = batch_size / to_units(time_local - batch_start);
+     lat = batch_latency / batch_size;
+     nbatches++;
+     tput_sum += tput;
+     tput_sumsq += tput*tput;
+     lat_sum += lat;
+     lat_sumsq += lat*lat;
+     }
+  warmup_done = 1;
+  batch_fill = 0;
+  batch_latency = 0;
+  batch_start = time_local;
+
+  if (nbatches >= MIN_BATCHES
+      && batch_halfwidth(tput_sum, tput_sumsq) <= target_precision * batch_mean(tput_sum)
+      && batch_halfwidth(lat_sum, lat_sumsq) <= target_precision * batch_mean(lat_sum)) {
+     precision_reached = 1;
+     if (TRACE>0)
+        printf("          EARLY STOP: target precision reached after %d batches\n", nbatches);
+     }
+}
+
+/************************** CHECKPOINTS ***************/
+/* A checkpoint is the simulator state between two events followed by   */
+/* whatever the protocol saves in protocol_checkpoint(). Resuming from   */
+/* it replays the rest of the run exactly. The seed, window and buffer   */
+/* sizes and flow count come from the checkpoint; loss, corruption,      */
+/* arrival rate and process, message count, drain rate and tracing come */
+/* from the command line.                                                */
+
+void checkpoint_io(void *data, int len)
+{
+  if (ckpt_saving) {
+     if (fwrite(data, 1, len, ckpt_fp) != (size_t)len) {
+        fprintf(stderr, "Unable to write checkpoint\n");
+        exit(-1);
+        }
+     }
+   else if (fread(data, 1, len, ckpt_fp) != (size_t)len) {
+     fprintf(stderr, "Checkpoint is truncated\n");
+     exit(-1);
+     }
+}
+
+int checkpoint_saving()
+{
+  return ckpt_saving;
+}
+
+/* save or restore everything the main loop carries between events */
+void checkpoint_simulator()
+{
+  struct event *q;
+  struct flow_state *f;
+  int nev, i, n;
+
+  checkpoint_io(&win_size, sizeof(win_size));
+  checkpoint_io(&rcv_bufsize, sizeof(rcv_bufsize));
+  checkpoint_io(&sndbuf_size, sizeof(sndbuf_size));
+  checkpoint_io(&fec_data, sizeof(fec_data));
+  checkpoint_io(&fec_parity, sizeof(fec_parity));
+  checkpoint_io(&channels, sizeof(channels));
+  checkpoint_io(&nflows, sizeof(nflows));
+  if (!ckpt_saving)
+     init_flows();
+
+  checkpoint_io(&time_local, sizeof(time_local));
+  checkpoint_io(&nsim, sizeof(nsim));
+  checkpoint_io(&ntolayer3, sizeof(ntolayer3));
+  checkpoint_io(&nlost, sizeof(nlost));
+  checkpoint_io(&ncorrupt, sizeof(ncorrupt));
+  checkpoint_io(&A_application, sizeof(A_application));
+  checkpoint_io(&A_transport, sizeof(A_transport));
+  checkpoint_io(&B_application, sizeof(B_application));
+  checkpoint_io(&B_transport, sizeof(B_transport));
+  checkpoint_io(lastarrival, sizeof(lastarrival));
+
+  for (f = flows; f < flows + nflows; f++) {
+     checkpoint_io(&f->A_application, sizeof(f->A_application));
+     checkpoint_io(&f->A_transport, sizeof(f->A_transport));
+     checkpoint_io(&f->B_application, sizeof(f->B_application));
+     checkpoint_io(&f->B_transport, sizeof(f->B_transport));
+     checkpoint_io(&f->bp.A_full, sizeof(f->bp.A_full));
+     checkpoint_io(&f->bp.arrival_blocked, sizeof(f->bp.arrival_blocked));
+     checkpoint_io(&f->blocked_since, sizeof(f->blocked_since));
+     checkpoint_io(&f->bp.full_since, sizeof(f->bp.full_since));
+     checkpoint_io(&f->bp.stall_time, sizeof(f->bp.stall_time));
+     checkpoint_io(&f->ndropped_l5, sizeof(f->ndropped_l5));
+     checkpoint_io(&f->last_delivery, sizeof(f->last_delivery));
+     checkpoint_io(&f->nsim, sizeof(f->nsim));
+     checkpoint_io(&f->evseq, sizeof(f->evseq));
+     checkpoint_io(&f->stream, sizeof(f->stream));
+     checkpoint_io(&f->arr_state, sizeof(f->arr_state));
+     checkpoint_io(&f->arr_switch, sizeof(f->arr_switch));
+     checkpoint_io(&f->arr_next, sizeof(f->arr_next));
+     checkpoint_io(&f->latency_sum, sizeof(f->latency_sum));
+     checkpoint_io(f->wire_bytes, sizeof(f->wire_bytes));
+     checkpoint_io(&f->latency_max, sizeof(f->latency_max));
+     checkpoint_io(&f->backlog_sum, sizeof(f->backlog_sum));
+     checkpoint_io(&f->backlog_max, sizeof(f->backlog_max));
+
+     checkpoint_io(&f->cur_msg_sent, sizeof(f->cur_msg_sent));
+     checkpoint_io(&f->cur_msg_recv, sizeof(f->cur_msg_recv));
+     if (!ckpt_saving) {
+        for (f->msgs_cap = TRACK_MIN; f->msgs_cap < f->cur_msg_sent - f->cur_msg_recv + 1; f->msgs_cap *= 2)
+           ;
+        f->application_msgs = (struct msg_track *)malloc(f->msgs_cap * sizeof(struct msg_track));
+        }
+     for (i = (f->cur_msg_recv > 0 ? f->cur_msg_recv - 1 : 0); i < f->cur_msg_sent; i++)
+        checkpoint_io(track(f, i), sizeof(struct msg_track));
+     }
+  checkpoint_io(&replay_pos, sizeof(replay_pos));
+  checkpoint_io(&replay_link_pos, sizeof(replay_link_pos));
+
+  checkpoint_io(&draining, sizeof(draining));
+  checkpoint_io(&last_msg_time, sizeof(last_msg_time));
+  checkpoint_io(&last_delivery, sizeof(last_delivery));
+  checkpoint_io(&drain_delivered, sizeof(drain_delivered));
+
+  checkpoint_io(&batch_fill, sizeof(batch_fill));
+  checkpoint_io(&batch_start, sizeof(batch_start));
+  checkpoint_io(&batch_latency, sizeof(batch_latency));
+  checkpoint_io(&warmup_done, sizeof(warmup_done));
+  checkpoint_io(&nbatches, sizeof(nbatches));
+  checkpoint_io(&tput_sum, sizeof(tput_sum));
+  checkpoint_io(&tput_sumsq, sizeof(tput_sumsq));
+  checkpoint_io(&lat_sum, sizeof(lat_sum));
+  checkpoint_io(&lat_sumsq, sizeof(lat_sumsq));
+
+  /* setstate() on the live state records its position in rng_state[0] */
+  if (ckpt_saving)
+     setstate(rng_state);
+  checkpoint_io(rng_state, sizeof(rng_state));
+  if (!ckpt_saving)
+     setstate(rng_state);
+
+  checkpoint_io(&channel_stream, sizeof(channel_stream));
+
+  /* the path and what its links hold */
+  checkpoint_io(&base_timeout, sizeof(base_timeout));
+  checkpoint_io(&nlinks, sizeof(nlinks));
+  for (i=0; i<nlinks; i++) {
+     checkpoint_io(&links[i].delay, sizeof(links[i].delay));
+     checkpoint_io(&links[i].loss, sizeof(links[i].loss));
+     checkpoint_io(&links[i].bandwidth, sizeof(links[i].bandwidth));
+     checkpoint_io(&links[i].queue, sizeof(links[i].queue));
+     links[i].sending[0].checkpoint();
+     links[i].sending[1].checkpoint();
+     checkpoint_io(links[i].busy_until, sizeof(links[i].busy_until));
+     checkpoint_io(links[i].last_arrival, sizeof(links[i].last_arrival));
+     checkpoint_io(links[i].nforwarded, sizeof(links[i].nforwarded));
+     checkpoint_io(links[i].nlost, sizeof(links[i].nlost));
+     checkpoint_io(links[i].nfull, sizeof(links[i].nfull));
+     checkpoint_io(links[i].queue_max, sizeof(links[i].queue_max));
+     }
+
+  /* pending events with their insertion numbers, stopped timers left out */
+  nev = 0;
+  for (i=0; i<main_queue.n; i++)
+     if (!main_queue.heap[i]->cancelled)
+        nev++;
+  checkpoint_io(&nev, sizeof(nev));
+  for (i=0, n=0; n<nev; i++) {
+     if (ckpt_saving) {
+        q = main_queue.heap[i];
+        if (q->cancelled)
+           continue;
+        }
+      else {
+        q = (struct event *)malloc(sizeof(struct event));
+        q->cancelled = 0;
+        }
+     checkpoint_io(&q->evtime, sizeof(q->evtime));
+     checkpoint_io(&q->evseq, sizeof(q->evseq));
+     checkpoint_io(&q->evtype, sizeof(q->evtype));
+     checkpoint_io(&q->eventity, sizeof(q->eventity));
+     checkpoint_io(&q->eventflow, sizeof(q->eventflow));
+     if (q->evtype == FROM_LAYER3 || q->evtype == TO_LINK) {
+        if (!ckpt_saving)
+           q->pktptr = (struct pkt *)malloc(sizeof(struct pkt));
+        checkpoint_io(q->pktptr, sizeof(struct pkt));
+        }
+     if (q->evtype == TO_LINK)
+        checkpoint_io(&q->evhop, sizeof(q->evhop));
+     if (!ckpt_saving) {
+        heap_push(&main_queue, q);
+        if (q->evtype == TIMER_INTERRUPT)
+           flows[q->eventflow].timer[q->eventity] = q;
+        }
+     n++;
+     }
+}
+
+void save_checkpoint()
+{
+  char tmpname[4096];
+
+  snprintf(tmpname, sizeof(tmpname), "%s.tmp", ckpt_file);
+  if ((ckpt_fp = fopen(tmpname, "wb")) == NULL) {
+     fprintf(stderr, "Unable to open %s\n", tmpname);
+     exit(-1);
+     }
+  ckpt_saving = 1;
+  checkpoint_io((void *)CKPT_MAGIC, 8);
+  checkpoint_simulator();
+  protocol_checkpoint();
+  fclose(ckpt_fp);
+  ckpt_fp = NULL;
+
+  /* only replace the previous checkpoint once this one is complete */
+  if (rename(tmpname, ckpt_file) != 0) {
+     fprintf(stderr, "Unable to write %s\n", ckpt_file);
+     exit(-1);
+     }
+  if (TRACE>0)
+     printf("          CHECKPOINT: saved at time %f\n", to_units(time_local));
+}
+
+/* next checkpoint is at the first multiple of the interval after the next event */
+void schedule_checkpoint()
+{
+  struct event *next = nextevent();
+  simtime t = (next != NULL) ? next->evtime : time_local;
+  simtime interval = to_ticks(ckpt_interval);
+  if (interval < 1)
+     interval = 1;
+  next_ckpt = interval * (t / interval + 1);
+}
+
+/* restore the simulator, before A_init() and B_init() */
+void begin_resume()
+{
+  char magic[8];
+
+  if ((ckpt_fp = fopen(resume_file, "rb")) == NULL) {
+     fprintf(stderr, "Unable to open %s\n", resume_file);
+     exit(-1);
+     }
+  ckpt_saving = 0;
+  checkpoint_io(magic, 8);
+  if (memcmp(magic, CKPT_MAGIC, 8) != 0) {
+     fprintf(stderr, "%s is not a checkpoint\n", resume_file);
+     exit(-1);
+     }
+  checkpoint_simulator();
+}
+
+/* restore the protocol, after A_init() and B_init() */
+void finish_resume()
+{
+  protocol_checkpoint();
+  fclose(ckpt_fp);
+  ckpt_fp = NULL;
+  if (TRACE>0)
+     printf("          CHECKPOINT: resumed at time %f\n", to_units(time_local));
+}
+
+/************************** PARALLEL ENGINE ***************/
+/* See struct partition for how a window works. Checkpoints, drain mode */
+/* and tracing need the events in one sequence and are not supported.   */
+
+void save_counters(struct flow_state *f, struct flow_counters *c)
+{
+  c->nsim = f->nsim;
+  c->A_application = f->A_application;
+  c->B_transport = f->B_transport;
+  c->B_application = f->B_application;
+  c->ndropped_l5 = f->ndropped_l5;
+  c->A_full = f->bp.A_full;
+  c->stalled = f->stalled;
+  c->full_since = f->bp.full_since;
+  c->stall_time = f->bp.stall_time;
+  c->last_delivery = f->last_delivery;
+  c->latency_sum = f->latency_sum;
+  c->latency_max = f->latency_max;
+  c->backlog_sum = f->backlog_sum;
+  c->backlog_max = f->backlog_max;
+}
+
+void restore_counters(struct flow_state *f, struct flow_counters *c)
+{
+  f->nsim = c->nsim;
+  f->A_application = c->A_application;
+  f->B_transport = c->B_transport;
+  f->B_application = c->B_application;
+  f->ndropped_l5 = c->ndropped_l5;
+  f->bp.A_full = c->A_full;
+  f->stalled = c->stalled;
+  f->bp.full_since = c->full_since;
+  f->bp.stall_time = c->stall_time;
+  f->last_delivery = c->last_delivery;
+  f->latency_sum = c->latency_sum;
+  f->latency_max = c->latency_max;
+  f->backlog_sum = c->backlog_sum;
+  f->backlog_max = c->backlog_max;
+}
+
+/* handle this thread's events up to the end of the window */
+void run_window()
+{
+  struct partition *pt = cur_part;
+  struct event *eventptr;
+  struct event_record *r;
+  int sends, deliveries;
+
+  pt->nevents = pt->nsends = pt->nlatencies = 0;
+  while ((eventptr = nextevent()) != NULL && eventptr->evtime < window_end) {
+     heap_pop(evq);
+     pt->events = (struct event_record *)grow_array(pt->events, pt->nevents, &pt->eventcap, sizeof(struct event_record));
+     r = &pt->events[pt->nevents++];
+     r->evtime = eventptr->evtime;
+     r->evseq = eventptr->evseq;
+     r->eventflow = eventptr->eventflow;
+     sends = pt->nsends;
+     deliveries = pt->nlatencies;
+     time_local = eventptr->evtime;
+     handle_event(eventptr);
+     r->nsends = pt->nsends - sends;
+     r->ndeliveries = pt->nlatencies - deliveries;
+     save_counters(&flows[r->eventflow], &r->after);
+     }
+}
+
+void *partition_thread(void *arg)
+{
+  cur_part = (struct partition *)arg;
+  evq = &cur_part->queue;
+  while (1) {
+     pthread_barrier_wait(&window_start);
+     if (parallel_done)
+        break;
+     run_window();
+     pthread_barrier_wait(&window_done);
+     }
+  return NULL;
+}
+
+/* replay the window's logs in sequential order: (time, flow, -evseq),   */
+/* as event_before(). Returns 1 if the run ended inside the window, with */
+/* time_local set to where the sequential engine would have stopped.    */
+int merge_window(struct flow_counters *committed)
+{
+  struct partition *pt, *next;
+  struct event_record *r, *nr;
+  struct send_record *sr;
+  struct event *evptr;
+  struct event_queue *q;
+  int i, p, from;
+
+  for (p=0; p<npartitions; p++)
+     partitions[p].ev_pos = partitions[p].send_pos = partitions[p].lat_pos = 0;
+  while (1) {
+     next = NULL;
+     r = NULL;
+     for (p=0; p<npartitions; p++) {
+        pt = &partitions[p];
+        if (pt->ev_pos == pt->nevents)
+           continue;
+        nr = &pt->events[pt->ev_pos];
+        if (r == NULL || nr->evtime < r->evtime
+            || (nr->evtime == r->evtime && nr->eventflow < r->eventflow)) {
+           next = pt;
+           r = nr;
+           }
+        }
+     if (next == NULL)
+        return 0;
+     next->ev_pos++;
+     nevents++;
+     time_local = r->evtime;
+     if (nsim == nsimmax || precision_reached || stalled_flow >= 0)
+        return 1;
+     cur_flow = r->eventflow;
+     nsim += r->after.nsim - committed[cur_flow].nsim;
+     committed[cur_flow] = r->after;
+     if (r->after.stalled)
+        stalled_flow = cur_flow;
+     /* the event's sends go into its flow's queue as one batch, as */
+     /* tolayer3_batch() puts them in the sequential engine          */
+     q = &partitions[cur_flow % npartitions].queue;
+     heap_reserve(q, r->nsends);
+     from = q->n;
+     for (i=0; i<r->nsends; i++) {
+        sr = &next->sends[next->send_pos++];
+        evptr = channel_arrival(sr->AorB, sr->packet);
+        if (evptr != NULL) {
+           evptr->evseq = sr->arrseq;
+           evptr->cancelled = 0;
+           q->heap[q->n++] = evptr;
+           }
+        }
+     heap_fix(q, from);
+     for (i=0; i<r->ndeliveries; i++)
+        record_delivery(next->latencies[next->lat_pos++]);
+     }
+}
+
+/* run the whole simulation on npartitions threads; the main thread */
+/* runs partition 0 and merges the windows                          */
+void run_parallel()
+{
+  struct flow_counters *committed;
+  struct event *eventptr, *top;
+  simtime tmin;
+  int i, p;
+
+  npartitions = nthreads < nflows ? nthreads : nflows;
+  partitions = (struct partition *)calloc(npartitions, sizeof(struct partition));
+  while ((eventptr = queue_top(&main_queue)) != NULL) {
+     heap_pop(&main_queue);
+     heap_push(&partitions[eventptr->eventflow % npartitions].queue, eventptr);
+     }
+  committed = (struct flow_counters *)malloc(nflows * sizeof(struct flow_counters));
+  for (i=0; i<nflows; i++)
+     save_counters(&flows[i], &committed[i]);
+
+  pthread_barrier_init(&window_start, NULL, npartitions);
+  pthread_barrier_init(&window_done, NULL, npartitions);
+  for (p=1; p<npartitions; p++)
+     pthread_create(&partitions[p].thread, NULL, partition_thread, &partitions[p]);
+
+  while (1) {
+     tmin = -1;
+     for (p=0; p<npartitions; p++)
+        if ((top = queue_top(&partitions[p].queue)) != NULL && (tmin < 0 || top->evtime < tmin))
+           tmin = top->evtime;
+     if (tmin < 0)
+        break;                       /* no events left, time_local is the last one's */
+     if (nsim == nsimmax || precision_reached || stalled_flow >= 0) {
+        time_local = tmin;
+        break;
+        }
+     /* a packet sent now queues behind those already in the channel */
+     window_end = lastarrival[A] < lastarrival[B] ? lastarrival[A] : lastarrival[B];
+     if (window_end < tmin)
+        window_end = tmin;
+     window_end += TICKS_PER_UNIT;
+     cur_part = &partitions[0];
+     evq = &partitions[0].queue;
+     pthread_barrier_wait(&window_start);
+     run_window();
+     pthread_barrier_wait(&window_done);
+     cur_part = NULL;
+     evq = &main_queue;
+     if (merge_window(committed))
+        break;
+     if (metrics_path != NULL)
+        check_metrics(committed);
+     }
+
+  parallel_done = 1;
+  pthread_barrier_wait(&window_start);
+  for (p=1; p<npartitions; p++)
+     pthread_join(partitions[p].thread, NULL);
+
+  /* the flows ran past the end of the run; keep what was merged */
+  A_application = B_transport = B_application = 0;
+  for (i=0; i<nflows; i++) {
+     restore_counters(&flows[i], &committed[i]);
+     A_application += flows[i].A_application;
+     B_transport += flows[i].B_transport;
+     B_application += flows[i].B_application;
+     }
+  free(committed);
+}
+
+/************************** LIVE METRICS ***************/
+/* With -M the simulator takes a snapshot of its counters in Prometheus  */
+/* text format every -I seconds of wall-clock time. A file is replaced  */
+/* whole with each one, as checkpoints are, so a reader such as a       */
+/* textfile collector never sees half of it; unix:PATH instead listens  */
+/* there and writes the latest snapshot to each connection. The         */
+/* snapshots are taken on the simulating thread between events, from   */
+/* the counters it keeps anyway, so nothing else is shared with the     */
+/* reader and a run without -M only counts its events.                 */
+
+double wall_seconds()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* hand each connection the latest snapshot */
+void *metrics_server(void *arg)
+{
+  char *text;
+  int fd;
+
+  while (1) {
+     if ((fd = accept(metrics_fd, NULL, NULL)) < 0) {
+        if (errno == EINTR || errno == ECONNABORTED)
+           continue;
+        return NULL;
+        }
+     pthread_mutex_lock(&metrics_lock);
+     text = strdup(metrics_text != NULL ? metrics_text : "");
+     pthread_mutex_unlock(&metrics_lock);
+     send(fd, text, strlen(text), MSG_NOSIGNAL);
+     free(text);
+     close(fd);
+     }
+}
+
+void start_metrics()
+{
+  struct sockaddr_un addr;
+  pthread_t thread;
+
+  if (strncmp(metrics_path, "unix:", 5) == 0) {
+     memset(&addr, 0, sizeof(addr));
+     addr.sun_family = AF_UNIX;
+     if (strlen(metrics_path+5) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path %s is too long\n", metrics_path+5);
+        exit(-1);
+        }
+     strcpy(addr.sun_path, metrics_path+5);
+     unlink(addr.sun_path);
+     if ((metrics_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0
+         || bind(metrics_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0
+         || listen(metrics_fd, 16) != 0) {
+        fprintf(stderr, "Unable to listen on %s\n", addr.sun_path);
+        exit(-1);
+        }
+     pthread_create(&thread, NULL, metrics_server, NULL);
+     pthread_detach(thread);
+     }
+  last_metrics_wall = wall_seconds();
+  last_metrics_events = nevents;
+  next_metrics = last_metrics_wall + metrics_interval;
+  publish_metrics(NULL);
+}
+
+/* take a snapshot if it is time for one */
+void check_metrics(struct flow_counters *committed)
+{
+  if (wall_seconds() >= next_metrics)
+     publish_metrics(committed);
+}
+
+/* one metric with its help and type lines */
+void metric(FILE *fp, const char *name, const char *type, const char *help, double value)
+{
+  fprintf(fp, "# HELP %s %s\n# TYPE %s %s\n%s %.17g\n", name, help, name, type, name, value);
+}
+
+/* the flows' counters are in committed while a parallel run is merging */
+/* windows, and in flows otherwise                                      */
+void publish_metrics(struct flow_counters *committed)
+{
+  struct flow_counters c, *fc;
+  char *text, tmpname[4096];
+  size_t len;
+  FILE *fp;
+  double now, rate;
+  long long sent, delivered, backlog;
+  int i, queued, full, backlog_max;
+
+  now = wall_seconds();
+  rate = now > last_metrics_wall ? (nevents - last_metrics_events) / (now - last_metrics_wall) : 0;
+  last_metrics_wall = now;
+  last_metrics_events = nevents;
+  next_metrics = now + metrics_interval;
+
+  sent = delivered = backlog = 0;
+  full = backlog_max = 0;
+  for (i=0; i<nflows; i++) {
+     if (committed != NULL)
+        fc = &committed[i];
+      else {
+        save_counters(&flows[i], &c);
+        fc = &c;
+        }
+     sent += fc->A_application;
+     delivered += fc->B_application;
+     backlog += fc->A_application - fc->B_application;
+     if (fc->A_application - fc->B_application > backlog_max)
+        backlog_max = fc->A_application - fc->B_application;
+     full += fc->A_full;
+     }
+  queued = main_queue.n;
+  for (i=0; i<npartitions; i++)
+     queued += partitions[i].queue.n;
+
+  fp = open_memstream(&text, &len);
+  metric(fp, "rtp_sim_time", "gauge", "Simulated time in time units.", to_units(time_local));
+  metric(fp, "rtp_events_total", "counter", "Events handled.", nevents);
+  metric(fp, "rtp_events_per_second", "gauge", "Events handled per wall-clock second since the last snapshot.", rate);
+  metric(fp, "rtp_messages_sent_total", "counter", "Messages given to A by layer5.", sent);
+  metric(fp, "rtp_messages_delivered_total", "counter", "Messages delivered to layer5 at B.", delivered);
+  metric(fp, "rtp_packets_total", "counter", "Packets given to layer3 by A and B.", ntolayer3);
+  metric(fp, "rtp_packets_lost_total", "counter", "Packets lost by the channel.", nlost);
+  metric(fp, "rtp_packets_corrupted_total", "counter", "Packets corrupted by the channel.", ncorrupt);
+  metric(fp, "rtp_retransmissions_total", "counter", "Packets A sent beyond one per message given to it.",
+         A_transport > sent ? A_transport - sent : 0);
+  metric(fp, "rtp_event_queue_depth", "gauge", "Events pending, stopped timers included until they come up.", queued);
+  metric(fp, "rtp_sender_backlog", "gauge", "Messages given to A and not yet delivered, over all flows.", backlog);
+  metric(fp, "rtp_sender_backlog_max", "gauge", "Largest backlog of a single flow.", backlog_max);
+  metric(fp, "rtp_sender_buffer_full_flows", "gauge", "Flows whose sender buffer is full.", full);
+  metric(fp, "rtp_window_size", "gauge", "Window size in packets.", win_size);
+  fclose(fp);
+
+  if (metrics_fd >= 0) {
+     pthread_mutex_lock(&metrics_lock);
+     free(metrics_text);
+     metrics_text = text;
+     pthread_mutex_unlock(&metrics_lock);
+     return;
+     }
+
+  snprintf(tmpname, sizeof(tmpname), "%s.tmp", metrics_path);
+  if ((fp = fopen(tmpname, "w")) == NULL || fwrite(text, 1, len, fp) != len || fclose(fp) != 0
+      || rename(tmpname, metrics_path) != 0) {
+     fprintf(stderr, "Unable to write %s\n", metrics_path);
+     exit(-1);
+     }
+  free(text);
+}
+
+/* the final snapshot; a socket stops listening with the process */
+void stop_metrics()
+{
+  publish_metrics(NULL);
+  if (metrics_fd >= 0)
+     unlink(metrics_path+5);
+}
+
 /********************** Student-callable ROUTINES ***********************/
 
 /* called by students routine to cancel a previously-started timer */
 void stoptimer(int AorB)
  //AorB;  /* A or B is trying to stop timer */
 {
- struct event *q,*qold;
+ struct event **timer = &flows[cur_flow].timer[AorB];
+ PROFILE_SCOPE("stoptimer");
 
  if (TRACE>2)
-    printf("          STOP TIMER: stopping timer at %f\n",time_local);
-/* for (q=evlist; q!=NULL && q->next!=NULL; q = q->next)  */
- for (q=evlist; q!=NULL ; q = q->next)
-    if ( (q->evtype==TIMER_INTERRUPT  && q->eventity==AorB) ) {
-       /* remove this event */
-       if (q->next==NULL && q->prev==NULL)
-             evlist=NULL;         /* remove first and only event on list */
-          else if (q->next==NULL) /* end of list - there is one in front */
-             q->prev->next = NULL;
-          else if (q==evlist) { /* front of list - there must be event after */
-             q->next->prev=NULL;
-             evlist = q->next;
-             }
-           else {     /* middle of list */
-             q->next->prev = q->prev;
-             q->prev->next =  q->next;
-             }
-       free(q);
-       return;
-     }
+    printf("          STOP TIMER: stopping timer at %f\n",to_units(time_local));
+ if (*timer != NULL) {
+    /* leave it in the heap, nextevent() discards it */
+    (*timer)->cancelled = 1;
+    *timer = NULL;
+    return;
+    }
   printf("Warning: unable to cancel your timer. It wasn't running.\n");
 }
 
 
-void starttimer(int AorB,float increment)
+void starttimer(int AorB,double increment)
 // AorB;  /* A or B is trying to stop timer */
 
 {
 
- struct event *q;
  struct event *evptr;
  ////char *malloc();
+ PROFILE_SCOPE("starttimer");
 
  if (TRACE>2)
-    printf("          START TIMER: starting timer at %f\n",time_local);
+    printf("          START TIMER: starting timer at %f\n",to_units(time_local));
  /* be nice: check to see if timer is already started, if so, then  warn */
-/* for (q=evlist; q!=NULL && q->next!=NULL; q = q->next)  */
-   for (q=evlist; q!=NULL ; q = q->next)
-    if ( (q->evtype==TIMER_INTERRUPT  && q->eventity==AorB) ) {
+   if (flows[cur_flow].timer[AorB] != NULL) {
       printf("Warning: attempt to start a timer that is already started\n");
       return;
       }
 
 /* create future event for when timer goes off */
    evptr = (struct event *)malloc(sizeof(struct event));
-   evptr->evtime =  time_local + increment;
+   evptr->evtime =  time_local + to_ticks(increment);
    evptr->evtype =  TIMER_INTERRUPT;
    evptr->eventity = AorB;
+   evptr->eventflow = cur_flow;
    insertevent(evptr);
+   flows[cur_flow].timer[AorB] = evptr;
+}
+
+
+/************************** CHANNEL TRACES ***************/
+/* -R writes one record per packet handed to layer 3: a byte holding   */
+/* CHAN_LOST or the corruption type, followed by the delay as a float  */
+/* unless the packet was lost. -P maps such a file and hands the same  */
+/* decisions out in order instead of drawing them from the channel's   */
+/* stream, so different protocols can be run against an identical      */
+/* channel. A -L link's loss draw is a record of its own, a byte with  */
+/* CHAN_LINK set, and is replayed in order among the link draws. A run */
+/* that needs more decisions than were recorded stops with an error.   */
+
+void open_channel_trace()
+{
+  int fd;
+  struct stat st;
+  void *map;
+
+  if (record_file != NULL) {
+     if ((record_fp = fopen(record_file, "wb")) == NULL) {
+        fprintf(stderr, "Unable to open %s\n", record_file);
+        exit(-1);
+        }
+     fwrite(CHAN_MAGIC, 1, 8, record_fp);
+     }
+
+  if (replay_file != NULL) {
+     if ((fd = open(replay_file, O_RDONLY)) < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Unable to open %s\n", replay_file);
+        exit(-1);
+        }
+     map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+     close(fd);
+     if (map == MAP_FAILED || st.st_size <= 8 || memcmp(map, CHAN_MAGIC, 8) != 0) {
+        fprintf(stderr, "%s is not a channel trace\n", replay_file);
+        exit(-1);
+        }
+     madvise(map, st.st_size, MADV_SEQUENTIAL);
+     replay_base = (const unsigned char *)map + 8;
+     replay_len = st.st_size - 8;
+     }
+}
+
+float channel_rand()
+{
+  return streamrand(&channel_stream);
 }
 
+/* Offset of the next link (link = 1) or packet (link = 0) decision at */
+/* or after *pos, moving *pos past it                                   */
+long replay_next(long *pos, int link)
+{
+  long at;
+  unsigned char code;
+
+  while (*pos < replay_len) {
+     at = *pos;
+     code = replay_base[at];
+     *pos += (code & (CHAN_LOST|CHAN_LINK)) ? 1 : 1 + sizeof(float);
+     if (((code & CHAN_LINK) != 0) == link)
+        return at;
+     }
+  fprintf(stderr, "%s holds no more %s decisions; record a run that sends at least as many packets\n",
+          replay_file, link ? "link" : "packet");
+  exit(-1);
+}
+
+/* decide the fate of the next packet */
+void channel_decide(struct channel_decision *d)
+{
+  float x;
+  unsigned char code;
+  long at;
+
+  if (replay_base != NULL) {
+     at = replay_next(&replay_pos, 0);
+     code = replay_base[at];
+     d->lost = (code & CHAN_LOST) != 0;
+     d->corrupt = code & 0x3;
+     if (!d->lost)
+        memcpy(&d->delay, replay_base + at + 1, sizeof(float));
+     return;
+     }
+
+  /* same draws, in the same order, as the original emulator */
+  d->lost = channel_rand() < lossprob;
+  d->corrupt = 0;
+  if (!d->lost) {
+     d->delay = 1 + 9*channel_rand();
+     if (channel_rand() < corruptprob) {
+        if ( (x = channel_rand()) < .75)
+           d->corrupt = 1;
+          else if (x < .875)
+           d->corrupt = 2;
+          else
+           d->corrupt = 3;
+        }
+     }
+
+  if (record_fp != NULL) {
+     code = d->lost ? CHAN_LOST : d->corrupt;
+     fwrite(&code, 1, 1, record_fp);
+     if (!d->lost)
+        fwrite(&d->delay, sizeof(float), 1, record_fp);
+     }
+}
 
 /************************** TOLAYER3 ***************/
-void tolayer3(int AorB,struct pkt packet)
+/* run one packet through the medium: returns its arrival event, or NULL */
+/* if the packet was lost. Draws from channel_rand() in the same order   */
+/* for every packet, whether it was sent alone or as part of a batch.    */
+struct event *channel_arrival(int AorB,struct pkt packet)
 {
  struct pkt *mypktptr;
- struct event *evptr,*q;
+ struct event *evptr;
+ struct channel_decision d;
  ////char *malloc();
- float lastime, x, jimsrand();
- int i;
+ simtime lastime;
+ unsigned char wire[WIRE_MAX];
+ int i, flow;
 
 
  ntolayer3++;
+ if (wire_report)
+    flows[cur_flow].wire_bytes[AorB] += wire_size(wire_format, cur_flow, &packet);
 
- if(AorB == 0) A_transport += 1;
+ if(AorB == 0) {
+    A_transport += 1;
+    flows[cur_flow].A_transport += 1;
+    }
+
+ channel_decide(&d);
 
  /* simulate losses: */
- if (jimsrand() < lossprob)  {
+ if (d.lost)  {
       nlost++;
       if (TRACE>0)
     printf("          TOLAYER3: packet being lost\n");
-      return;
+      return NULL;
     }
 
 /* make a copy of the packet student just gave me since he/she may decide */
@@ -549,26 +2122,28 @@ void tolayer3(int AorB,struct pkt packet)
   evptr = (struct event *)malloc(sizeof(struct event));
   evptr->evtype =  FROM_LAYER3;   /* packet will pop out from layer3 */
   evptr->eventity = (AorB+1) % 2; /* event occurs at other entity */
+  evptr->eventflow = cur_flow;    /* and belongs to the same flow */
   evptr->pktptr = mypktptr;       /* save ptr to my copy of packet */
 /* finally, compute the arrival time of packet at the other end.
    medium can not reorder, so make sure packet arrives between 1 and 10
    time units after the latest arrival time of packets
    currently in the medium on their way to the destination */
- lastime = time_local;
-/* for (q=evlist; q!=NULL && q->next!=NULL; q = q->next) */
- for (q=evlist; q!=NULL ; q = q->next)
-    if ( (q->evtype==FROM_LAYER3  && q->eventity==evptr->eventity) )
-      lastime = q->evtime;
- evptr->evtime =  lastime + 1 + 9*jimsrand();
+ if (nlinks == 0) {
+    lastime = time_local;
+    if (lastarrival[evptr->eventity] > lastime)
+       lastime = lastarrival[evptr->eventity];
+    evptr->evtime =  lastime + to_ticks(d.delay);
+    lastarrival[evptr->eventity] = evptr->evtime;
+    }
 
 
 
  /* simulate corruption: */
- if (jimsrand() < corruptprob)  {
+ if (d.corrupt)  {
     ncorrupt++;
-    if ( (x = jimsrand()) < .75)
+    if (d.corrupt == 1)
        mypktptr->payload[0]='Z';   /* corrupt payload */
-      else if (x < .875)
+      else if (d.corrupt == 2)
        mypktptr->seqnum = 999999;
       else
        mypktptr->acknum = 999999;
@@ -576,14 +2151,174 @@ void tolayer3(int AorB,struct pkt packet)
     printf("          TOLAYER3: packet being corrupted\n");
     }
 
+ /* what arrives is what the encoding carried */
+ if (wire_format != WIRE_RAW)
+    wire_decode(wire_format, wire, wire_encode(wire_format, cur_flow, mypktptr, wire), &flow, mypktptr);
+
+ /* on a multi-hop path the first link takes it from here */
+ if (nlinks > 0) {
+    evptr->evhop = 0;
+    if (!link_forward(evptr)) {
+       free(mypktptr);
+       free(evptr);
+       return NULL;
+       }
+    }
+
   if (TRACE>2)
      printf("          TOLAYER3: scheduling arrival on other side\n");
-  insertevent(evptr);
+  return evptr;
+}
+
+/* does link l lose the packet it is forwarding? see -R and -P */
+int link_lost(struct link *l)
+{
+ unsigned char code;
+ int lost;
+
+ if (replay_base != NULL)
+    return (replay_base[replay_next(&replay_link_pos, 1)] & CHAN_LOST) != 0;
+ lost = channel_rand() < l->loss;
+ if (record_fp != NULL) {
+    code = CHAN_LINK | (lost ? CHAN_LOST : 0);
+    fwrite(&code, 1, 1, record_fp);
+    }
+ return lost;
+}
+
+/* Put a packet on the next link of its path at time_local: it waits    */
+/* behind the packets queued there, takes its wire size over the link's */
+/* bandwidth to transmit and the link's delay to reach the far end,     */
+/* where it goes to the next router or, after the last link, to the     */
+/* other side. Returns 0 if the queue was full or the link lost it.     */
+int link_forward(struct event *ev)
+{
+ int dir = ev->eventity == B ? 0 : 1;
+ int hop = dir == 0 ? ev->evhop : nlinks - 1 - ev->evhop;
+ struct link *l = &links[hop];
+ ring_buffer<simtime> *q = &l->sending[dir];
+ simtime finish;
+
+ while (!q->empty() && q->front() <= time_local)
+    q->pop();
+ if (q->full()) {
+    l->nfull[dir]++;
+    if (TRACE>0)
+       printf("          LINK %d: queue full, packet dropped\n", hop);
+    return 0;
+    }
+
+ /* store, then transmit once the transmitter is free */
+ finish = l->busy_until[dir] > time_local ? l->busy_until[dir] : time_local;
+ if (l->bandwidth > 0)
+    finish += to_ticks(wire_size(wire_format, ev->eventflow, ev->pktptr)/l->bandwidth);
+ l->busy_until[dir] = finish;
+ q->push(finish);
+ if (q->size() > l->queue_max[dir])
+    l->queue_max[dir] = q->size();
+
+ if (l->loss > 0 && link_lost(l)) {
+    l->nlost[dir]++;
+    if (TRACE>0)
+       printf("          LINK %d: packet being lost\n", hop);
+    return 0;
+    }
+
+ /* the link can not reorder either */
+ ev->evtime = finish + to_ticks(l->delay);
+ if (ev->evtime <= l->last_arrival[dir])
+    ev->evtime = l->last_arrival[dir] + 1;
+ l->last_arrival[dir] = ev->evtime;
+ l->nforwarded[dir]++;
+ ev->evhop++;
+ ev->evtype = ev->evhop == nlinks ? FROM_LAYER3 : TO_LINK;
+ return 1;
+}
+
+/* Parse one -L option: DELAY[:LOSS[:BANDWIDTH[:QUEUE]]] */
+void add_link(char *arg)
+{
+ struct link *l;
+ int i;
+
+ if (nlinks == MAXLINKS) {
+    fprintf(stderr, "At most %d links with -L\n", MAXLINKS);
+    exit(-1);
+    }
+ l = &links[nlinks++];
+ l->loss = 0;
+ l->bandwidth = 0;
+ l->queue = 0;
+ if (sscanf(arg, "%lf:%f:%lf:%d", &l->delay, &l->loss, &l->bandwidth, &l->queue) < 1
+     || l->delay < 0 || l->loss < 0 || l->loss > 1 || l->bandwidth < 0 || l->queue < 0) {
+    fprintf(stderr, "Invalid value for -L: %s\n", arg);
+    exit(-1);
+    }
+ for (i=0; i<2; i++)
+    l->sending[i].init(l->queue > 0 ? l->queue : INT_MAX);
+}
+
+/* inside a parallel window the channel is run later, at the barrier */
+void log_send(int AorB,struct pkt packet)
+{
+ struct partition *pt = cur_part;
+ struct send_record *sr;
+
+ pt->sends = (struct send_record *)grow_array(pt->sends, pt->nsends, &pt->sendcap, sizeof(struct send_record));
+ sr = &pt->sends[pt->nsends++];
+ sr->AorB = AorB;
+ sr->arrseq = flows[cur_flow].evseq++;
+ sr->packet = packet;
+}
+
+void tolayer3(int AorB,struct pkt packet)
+{
+ struct event *evptr;
+ PROFILE_SCOPE("tolayer3");
+
+ if (cur_part != NULL) {
+    log_send(AorB, packet);
+    return;
+    }
+ evptr = channel_arrival(AorB, packet);
+ if (evptr != NULL)
+    insertevent(evptr);
+}
+
+/* send count packets back to back; each sees the same loss, delay and */
+/* corruption as a separate tolayer3() call, but their arrival events  */
+/* go into the event list in one pass                                  */
+void tolayer3_batch(int AorB,struct pkt *packets,int count)
+{
+ struct event *evptr;
+ int i, from;
+ PROFILE_SCOPE("tolayer3_batch");
+
+ if (count <= 0)
+    return;
+ if (cur_part != NULL) {
+    for (i=0; i<count; i++)
+       log_send(AorB, packets[i]);
+    return;
+    }
+ /* store the arrivals straight into the heap, then fix it up once */
+ heap_reserve(evq, count);
+ from = evq->n;
+ for (i=0; i<count; i++)
+    if ((evptr = channel_arrival(AorB, packets[i])) != NULL) {
+       stamp_event(evptr);
+       evq->heap[evq->n++] = evptr;
+       }
+ heap_fix(evq, from);
 }
 
 void tolayer5(int AorB,char *datasent)
 {
+  struct flow_state *f = &flows[cur_flow];
+  struct partition *pt;
+  double latency;
   int i;
+  PROFILE_SCOPE("tolayer5");
   if (TRACE>2) {
      printf("          TOLAYER5: data received: ");
      for (i=0; i<20; i++)
@@ -591,40 +2326,102 @@ void tolayer5(int AorB,char *datasent)
      printf("\n");
    }
 
-   /* Check for non-existent packet */
-   if (application_msgs[cur_msg_recv].msg_chars[0] == '\0') {
-       printf("PANIC: Unexpected/Non-existent packet!");
-       exit(52);
-   }
+  check_delivery(f->cur_msg_recv < f->cur_msg_sent ? track(f, f->cur_msg_recv)->msg_chars : NULL, datasent);
 
-  /* Check for out-of-order/duplicate packets */
-  if (strncmp(application_msgs[cur_msg_recv].msg_chars, datasent, 20) != 0){
-    printf("Expected: ");
-    for(int i=0; i<20; i+=1)
-      printf("%c", application_msgs[cur_msg_recv].msg_chars[i]);
-    printf("\nGot: ");
-    for(int i=0; i<20; i+=1)
-      printf("%c", datasent[i]);
-    exit(63);
+  if (f->cur_msg_recv != 0){
+    if (track(f, f->cur_msg_recv-1)->delivered != 1)
+      exit(145);
   }
 
-  if (cur_msg_recv != 0){
-    if (application_msgs[cur_msg_recv-1].delivered != 1)
-      exit(145);
+  track(f, f->cur_msg_recv)->delivered = 1; // Mark delivered
+  f->last_delivery = time_local;
+  f->latency_sum += time_local - track(f, f->cur_msg_recv)->sent_time;
+  if (time_local - track(f, f->cur_msg_recv)->sent_time > f->latency_max)
+     f->latency_max = time_local - track(f, f->cur_msg_recv)->sent_time;
+  if (cur_part == NULL)
+     last_delivery = time_local;
+  if (target_precision > 0) {
+     latency = to_units(time_local - track(f, f->cur_msg_recv)->sent_time);
+     if (cur_part == NULL)
+        record_delivery(latency);
+      else {
+        pt = cur_part;       /* batches are filled in order at the barrier */
+        pt->latencies = (double *)grow_array(pt->latencies, pt->nlatencies, &pt->latencycap, sizeof(double));
+        pt->latencies[pt->nlatencies++] = latency;
+      }
+     }
+  f->cur_msg_recv += 1;
+
+  if(AorB == 1) {
+    if (cur_part == NULL)
+       B_application += 1;
+    f->B_application += 1;
   }
+}
+
+/* called by A when its send buffer fills up (full = 1) or has room again */
+void layer5_backpressure(int AorB, int full)
+{
+  struct event *evptr;
 
-  application_msgs[cur_msg_recv].delivered = 1; // Mark delivered
-  cur_msg_recv += 1;
+  if (AorB != A || !sender_backpressure(&flows[cur_flow].bp, full, to_units(time_local)))
+     return;
+  evptr = (struct event *)malloc(sizeof(struct event));
+  evptr->evtime = time_local;
+  evptr->evtype = FROM_LAYER5;
+  evptr->eventity = A;
+  evptr->eventflow = cur_flow;
+  insertevent(evptr);
+}
 
-  if(AorB == 1) B_application += 1;
+/* deliver count consecutive in order messages to layer5 */
+void tolayer5_batch(int AorB, struct msg *msgs, int count)
+{
+  int i;
+  for (i=0; i<count; i++)
+     tolayer5(AorB, msgs[i].data);
+}
+
+/* The protocol's base timeout: -T if given, else its own default dflt  */
+/* plus the round trip of the -L path. That is each link's delay both   */
+/* ways, the transmission time of a full data packet towards B and of   */
+/* an ACK back, and the wait at the slowest link behind the inflight    */
+/* data packets every flow may have sent before this one. The sizes are */
+/* those of the -W encoding, which under compact shrinks an ACK to a    */
+/* header but not a packet carrying all 20 payload bytes.               */
+double gettimeout(double dflt, int inflight)
+{
+    struct pkt data, ack;
+    double rtt = 0, slowest = 0, tx_data, tx_ack;
+    int i;
+
+    if (base_timeout > 0)
+       return base_timeout;
+    memset(&ack, 0, sizeof(ack));
+    data = ack;
+    memset(data.payload, 'a', sizeof(data.payload));
+    for (i=0; i<nlinks; i++) {
+       tx_data = tx_ack = 0;
+       if (links[i].bandwidth > 0) {
+          tx_data = wire_size(wire_format, 0, &data)/links[i].bandwidth;
+          tx_ack = wire_size(wire_format, 0, &ack)/links[i].bandwidth;
+          }
+       rtt += 2*links[i].delay + tx_data + tx_ack;
+       if (tx_data > slowest)
+          slowest = tx_data;
+       }
+    if (inflight*nflows > 1)
+       rtt += (inflight*nflows - 1)*slowest;
+    return dflt + rtt;
 }
 
-int getwinsize()
+double get_sim_time()
 {
-    return win_size;
+    return to_units(time_local);
 }
 
-float get_sim_time()
+/* flow whose A or B is being called, 0 .. getnflows()-1 */
+int getflow()
 {
-    return time_local;
+    return cur_flow;
 }
@@ -1,5 +1,11 @@
 #include "../include/simulator.h"
+#include "../include/checkpoint.h"
+#include "../include/profile.h"
+#include "../include/ring_buffer.h"
+#include "../include/seq_bitmap.h"
+#include "../include/window_array.h"
 
+#include <deque>
 #include <queue>
 #include <stdio.h>
 #include <string.h>
@@ -20,28 +26,123 @@ using namespace std;
 **********************************************************************/
 
 struct windowItem{
-  float timesent;
+  double timesent;
   struct pkt p;
   int delivered;
+  bool resent;          /* Went out more than once, so its ACK times no send */
+  double firstsent;     /* When it first went out */
+  double ackedat;       /* When its first ACK came in */
 };
 
-/* A Variables */
-queue<struct pkt> A_pkt_buffer;         /* Queue to hold buffered send packets */
-struct windowItem pkts_sent[1000];      /* Packets Sent with Sent Time */
+static const float DEFAULT_TIMEOUT = 20;  /* TIMEOUT off a -L path, see gettimeout() */
+static float TIMEOUT;             /* timeout before timer interrupt is called */
+static float MAX_TIMEOUT;         /* cap on the backed off timeout, 16 TIMEOUTs */
+static const int NAK = -1;        /* seqnum of a packet from B asking for acknum again */
+static const int PARITY = -2;     /* seqnum of an FEC parity packet, see fecAdd() */
+#define FEC_MAX_DATA 64           /* data packets per FEC block, one bit each in fecBlock */
+#define FEC_MAX_PARITY 8          /* parity packets per FEC block */
+
+/* What B has seen of one FEC block. Data packet i of the block is in */
+/* group i % P, and parity packet j is the XOR of group j's payloads.  */
+struct fecBlock {
+  int block;                        /* Block number, -1 if unused */
+  uint64_t received;                /* Bit i set once data packet i arrived */
+  int have_parity;                  /* Bit j set once parity packet j arrived */
+  char data_xor[FEC_MAX_PARITY][20];     /* XOR of group j's payloads that arrived */
+  char parity[FEC_MAX_PARITY][20];
+};
 
-int N;                            /* Window Size */
-int base;                         /* Base of window */
-int nextseqnum;                   /* Next Seq Number */
+/* A Variables, one set per flow; W is the window size, or 0 if it is */
+/* only known at run time                                              */
+template <int W>
+struct sender {
+  ring_buffer<struct pkt> A_pkt_buffer;   /* Queue to hold buffered send packets */
+  window_array<struct windowItem, seq_bitmap<W>::bits> pkts_sent;   /* Packets Sent with Sent Time, indexed by snd_acked slot */
+  seq_bitmap<W> snd_acked;          /* Bit set for each acked packet in the window */
+  deque< pair<double,int> > send_times;    /* (time sent, seqnum) of every send, oldest first */
+  vector<struct pkt> burst;         /* Packets released together by one ACK */
+
+  int N;                            /* Window Size */
+  int base;                         /* Base of window */
+  int nextseqnum;                   /* Next Seq Number */
+
+  pair<double,struct windowItem> timer_start_pkt;  /* Pair to hold the start time and pkt that started it */
+
+  int pkts_unacked;                 /* Keep track of unacked pkts */
+  double rto;                       /* Current timeout, doubled when one went off early and set from srtt by an ACK of a packet sent once */
+  double srtt, rttvar;              /* Smoothed round trip time and its variation, srtt < 0 before the first sample */
+
+  int peer_rcv_base;                /* Receiver base last advertised by B */
+  int peer_rwnd;                    /* Free receiver buffer last advertised by B */
+  bool persist_timer;               /* Timer is probing a closed window */
+
+  int fec_k, fec_p;                 /* FEC data and parity packets per block, fec_k = 0 is off */
+  vector<struct pkt> fec_parity;    /* Parity of the block being sent, one per group */
+
+  void updateTimerStartTime(double _time,struct windowItem w);
+  double getTimerStartTime();
+  struct windowItem getTimerStartWindowItem();
+  bool A_window_open();
+  struct windowItem &sentItem(int seqnum);
+  void recordSend(struct windowItem w);
+  void sampleRtt(double rtt);
+  void restartTimer();
+  void startPersist();
+  void resend(int seqnum);
+  void fecAdd(struct pkt p);
+  void output(struct msg message);
+  void input(struct pkt ack_packet);
+  void timerinterrupt();
+  void init();
+  void checkpoint();
+};
 
-static float TIMEOUT = 20;        /* timeout before timer interrupt is called */     
+/* B Variables, one set per flow, W as for sender */
+template <int W>
+struct receiver {
+  int N;                            /* Window Size */
+  int rcv_base;                     /* Base for receiver */
+  seq_bitmap<W> rcv_window;         /* Bit set for each buffered packet in B's window */
+  window_array<struct msg, seq_bitmap<W>::bits> rcv_slots;   /* Buffered payloads, indexed by rcv_window slot */
+
+  int B_bufsize;                    /* Receiver buffer size in packets */
+  float B_drain_rate;               /* Layer5 consume rate, 0 = immediate */
+  queue<struct msg> B_deliver_buffer;     /* In order messages waiting for layer5 */
+  bool B_timer_running;             /* B's drain timer is running */
+  bool naks;                        /* NAK gaps and corrupt packets (-n) */
+  seq_bitmap<W> rcv_naked;          /* Bit set for each missing packet already NAKed */
+  int fec_k, fec_p;                 /* As for sender */
+  vector<struct fecBlock> fec_blocks;     /* Blocks around the window, by block % size */
+
+  int B_rwnd();
+  void B_send_ack(int acknum);
+  void B_send_naks(int upto);
+  struct fecBlock *fecFind(int block);
+  void fecRecover(struct fecBlock *f,int group);
+  void fecData(struct pkt p);
+  void fecParity(struct pkt p);
+  void B_deliver(struct msg *msgs,int count);
+  void input(struct pkt recvd_packet);
+  void timerinterrupt();
+  void init();
+  void checkpoint();
+};
 
-pair<float,struct windowItem> timer_start_pkt;  /* Pair to hold the start time and pkt that started it */
+template <int W> vector<struct sender<W> > A_flows;
+template <int W> vector<struct receiver<W> > B_flows;
 
-int pkts_unacked;                 /* Keep track of unacked pkts */
+/* Run f on the senders or receivers built for the current window size */
+template <typename F>
+void with_senders(F f)
+{
+  with_window(getwinsize(),[&](auto w){ f(A_flows<decltype(w)::value>); });
+}
 
-/* B Variables */
-int rcv_base;                     /* Base for receiver */
-struct windowItem pkts_recvd[1000];      /* Buffered packets for B, recver */
+template <typename F>
+void with_receivers(F f)
+{
+  with_window(getwinsize(),[&](auto w){ f(B_flows<decltype(w)::value>); });
+}
 
 
 void printpacketinfo(int AorB,struct windowItem w){
@@ -59,6 +160,7 @@ void printpacketinfo(int AorB,struct windowItem w){
 }
 
 int compute_checksum(struct pkt p){
+  PROFILE_SCOPE("compute_checksum");
   int checksum = 0;
   int payload_sum = 0;
 
@@ -68,19 +170,146 @@ int compute_checksum(struct pkt p){
   checksum = p.seqnum + p.acknum + payload_sum;
   return checksum;
 }
-void updateTimerStartTime(float _time,struct windowItem w){
+template <int W>
+void sender<W>::updateTimerStartTime(double _time,struct windowItem w){
   timer_start_pkt.first = _time;
   timer_start_pkt.second = w;
 }
-float getTimerStartTime(){
+template <int W>
+double sender<W>::getTimerStartTime(){
   return timer_start_pkt.first;
 }
-struct windowItem getTimerStartWindowItem(){
+template <int W>
+struct windowItem sender<W>::getTimerStartWindowItem(){
   return timer_start_pkt.second;
 }
 
+/* ACKs carry B's rcv_base and free buffer space in the otherwise unused payload */
+void setWindowAdvert(struct pkt *p,int rcvbase,int rwnd){
+  memset(p->payload,0,sizeof(p->payload));
+  memcpy(p->payload,&rcvbase,sizeof(int));
+  memcpy(p->payload + sizeof(int),&rwnd,sizeof(int));
+}
+void getWindowAdvert(struct pkt p,int *rcvbase,int *rwnd){
+  memcpy(rcvbase,p.payload,sizeof(int));
+  memcpy(rwnd,p.payload + sizeof(int),sizeof(int));
+}
+
+/* Next seqnum fits both the send window and B's advertised buffer */
+template <int W>
+bool sender<W>::A_window_open(){
+  return nextseqnum < base + N && nextseqnum < peer_rcv_base + peer_rwnd;
+}
+
+/* Window slot holding seqnum */
+template <int W>
+struct windowItem &sender<W>::sentItem(int seqnum){
+  return pkts_sent[snd_acked.slot(seqnum)];
+}
+
+/* Store a (re)sent packet and queue its deadline */
+template <int W>
+void sender<W>::recordSend(struct windowItem w){
+  sentItem(w.p.seqnum) = w;
+  send_times.push_back(make_pair(w.timesent,w.p.seqnum));
+}
+
+/* Set the timeout from the round trip time of a packet sent once, at  */
+/* least TIMEOUT above the smoothed round trip. An ACK for a resent    */
+/* packet may be for either copy, so it leaves a backed off timeout    */
+/* alone (Karn's rule).                                                */
+template <int W>
+void sender<W>::sampleRtt(double rtt){
+  if(srtt < 0){
+    srtt = rtt;
+    rttvar = rtt / 2;
+  }else{
+    rttvar = 0.75 * rttvar + 0.25 * (srtt > rtt ? srtt - rtt : rtt - srtt);
+    srtt = 0.875 * srtt + 0.125 * rtt;
+  }
+  rto = srtt + (4 * rttvar > TIMEOUT ? 4 * rttvar : TIMEOUT);
+  if(rto > MAX_TIMEOUT){
+    rto = MAX_TIMEOUT;
+  }
+}
+
+/* Point the timer at the unacked packet that will time out first */
+template <int W>
+void sender<W>::restartTimer(){
+  /* Drop entries for packets since acked or re-sent */
+  while(send_times.size() > 0){
+    int seq = send_times.front().second;
+    if(seq >= base && !snd_acked.test(seq) && sentItem(seq).timesent == send_times.front().first){
+      break;
+    }
+    send_times.pop_front();
+  }
+  if(send_times.size() == 0){
+    /* Everything is acked */
+    return;
+  }
+
+  struct windowItem &next = sentItem(send_times.front().second);
+  double t = rto - (get_sim_time() - next.timesent);
+  if(t < 0){
+    t = 0;
+  }
+  updateTimerStartTime(next.timesent,next);
+  starttimer(0,t);
+}
+
+/* B has no room and nothing is in flight to bring back an update - probe it */
+template <int W>
+void sender<W>::startPersist(){
+  if(!persist_timer && pkts_unacked == 0 && A_pkt_buffer.size() > 0 && nextseqnum > 0){
+    persist_timer = true;
+    starttimer(0,TIMEOUT);
+  }
+}
+
+/* Send an unacked packet again before its timeout, B NAKed it */
+template <int W>
+void sender<W>::resend(int seqnum){
+  struct windowItem w = sentItem(seqnum);
+  w.timesent = get_sim_time();
+  w.resent = true;
+  tolayer3(0,w.p);
+  recordSend(w);
+
+  /* Its deadline moved - the timer may have been waiting for it */
+  if(seqnum == getTimerStartWindowItem().p.seqnum){
+    stoptimer(0);
+    restartTimer();
+  }
+}
+
+/* XOR a data packet sent for the first time into its block's parity; */
+/* once the block's last packet is in, its parity packets follow it in */
+/* burst. Retransmissions are not protected again.                    */
+template <int W>
+void sender<W>::fecAdd(struct pkt p){
+  if(fec_k == 0){
+    return;
+  }
+  int i = p.seqnum % fec_k;
+  struct pkt &parity = fec_parity[i % fec_p];
+  for(int b = 0; b < sizeof(p.payload); b++){
+    parity.payload[b] ^= p.payload[b];
+  }
+  if(i == fec_k - 1){
+    for(int j = 0; j < fec_p; j++){
+      fec_parity[j].seqnum = PARITY;
+      fec_parity[j].acknum = p.seqnum - i + j;   /* First data packet of its group */
+      fec_parity[j].checksum = compute_checksum(fec_parity[j]);
+      burst.push_back(fec_parity[j]);
+      memset(&fec_parity[j],0,sizeof(struct pkt));
+    }
+  }
+}
+
 /* called from layer 5, passed the data to be sent to other side */
-void A_output(struct msg message)
+template <int W>
+void sender<W>::output(struct msg message)
 {
 
   /* Build new packet */
@@ -90,7 +319,7 @@ void A_output(struct msg message)
   memcpy(pkt.payload,message.data,sizeof(message.data));
   
   /* check if next seqnum is outside of window OR there are buffered packets */
-  if(nextseqnum < base + N && A_pkt_buffer.size() == 0){
+  if(A_window_open() && A_pkt_buffer.size() == 0){
 
     /* Set Packet Values */
     pkt.seqnum = nextseqnum;
@@ -102,13 +331,15 @@ void A_output(struct msg message)
     windowItem w;
     w.p = pkt;
     w.timesent = get_sim_time();
-    pkts_sent[nextseqnum] = w;
+    w.firstsent = w.timesent;
+    w.resent = false;
+    recordSend(w);
 
 
     /* Start timer if first packet sent in window */
     int val = nextseqnum - base;
     if(val == 0){     
-      starttimer(0,TIMEOUT);
+      starttimer(0,rto);
       updateTimerStartTime(get_sim_time(),w);
     }
 
@@ -117,16 +348,28 @@ void A_output(struct msg message)
     pkts_unacked++;
     tolayer3(0,pkt);
 
+    /* Parity, if this completed an FEC block */
+    if(fec_k > 0){
+      burst.clear();
+      fecAdd(pkt);
+      tolayer3_batch(0,burst.data(),burst.size());
+    }
+
     /* Increment next seq num */
     nextseqnum++;
   }else{
     /* Buffer Packet to be sent later */
     A_pkt_buffer.push(pkt);
+    layer5_backpressure(0,A_pkt_buffer.full());
+
+    /* The window may have closed after the last ACK came in */
+    startPersist();
   }
 }
 
 /* called from layer 3, when a packet arrives for layer 4 */
-void A_input(struct pkt ack_packet)
+template <int W>
+void sender<W>::input(struct pkt ack_packet)
 {
 
   /* Check if ACK is corrupted */
@@ -135,87 +378,112 @@ void A_input(struct pkt ack_packet)
 
   if(checksum != ack_packet.checksum){
     /* ACK Corrupted. Let Timeout */
+    return;
+  }
 
-  }else if(ack_packet.acknum >= base && ack_packet.acknum <= base + N){
-    /* Print Ack Packet information */
-    struct windowItem temp;
-    temp.p = ack_packet;
-    temp.timesent = -1;
+  /* Every ACK carries B's current buffer space */
+  int adv_base, adv_rwnd;
+  getWindowAdvert(ack_packet,&adv_base,&adv_rwnd);
+  if(adv_base >= peer_rcv_base){
+    peer_rcv_base = adv_base;
+    peer_rwnd = adv_rwnd;
+  }
 
-    /* Stop Timer if Packet is the packet that started the timer */
-    struct windowItem timer_start_packet = getTimerStartWindowItem();
-    if(ack_packet.acknum == timer_start_packet.p.seqnum){
-      stoptimer(0);
+  if(ack_packet.seqnum == NAK){
+    /* B is missing acknum */
+    if(!persist_timer && ack_packet.acknum >= base && ack_packet.acknum < nextseqnum &&
+       !snd_acked.test(ack_packet.acknum)){
+      resend(ack_packet.acknum);
     }
+  }else if(ack_packet.acknum >= base && ack_packet.acknum < nextseqnum &&
+     !snd_acked.test(ack_packet.acknum)){
 
-    /* Set Packet in pkts_sent as acked */
-    pkts_sent[ack_packet.acknum].p.acknum = ack_packet.acknum;
+    /* Set Packet as acked */
+    snd_acked.set(ack_packet.acknum);
     pkts_unacked --;
 
-    /* Increment Base */
-    if(ack_packet.acknum == base){
-
-      base = ack_packet.acknum + 1;
-      for(int i = base; i <= nextseqnum; i++){
-        if(pkts_sent[i].p.seqnum == 0){
-          /* Found Next Unacked Packet */
-          base = i;
-          break;
-        }
-      }
+    /* Time the round trip, unless the packet was resent */
+    struct windowItem &acked = sentItem(ack_packet.acknum);
+    acked.ackedat = get_sim_time();
+    if(!acked.resent){
+      sampleRtt(acked.ackedat - acked.timesent);
     }
 
-    /* Send a buffered packet if able to */
-    if(nextseqnum < base + N){
-
-      /* Send Next Packet in Buffer */
-      if(A_pkt_buffer.size() > 0){  
-        int i = 1;
+    /* Move Timer to next packet if Packet is the packet that started the timer */
+    struct windowItem timer_start_packet = getTimerStartWindowItem();
+    if(!persist_timer && ack_packet.acknum == timer_start_packet.p.seqnum){
+      stoptimer(0);
+      restartTimer();
+    }
 
-        while(i < N && A_pkt_buffer.size() > 0){
+    /* Increment Base */
+    if(ack_packet.acknum == base){
+      int run = snd_acked.run_length(base,nextseqnum - base);
+      snd_acked.clear_run(base,run);
+      base = base + run;
+    }
+  }else if(!persist_timer && ack_packet.acknum < nextseqnum &&
+           ack_packet.acknum >= nextseqnum - snd_acked.capacity() &&
+           sentItem(ack_packet.acknum).p.seqnum == ack_packet.acknum &&
+           sentItem(ack_packet.acknum).resent){
+    /* Second ACK for a packet sent twice - both copies got through, so */
+    /* the timeout went off early and, as the channel keeps order, the  */
+    /* first ACK was for the first copy. Time that round trip and back  */
+    /* off until a packet sent once is acked.                           */
+    struct windowItem &acked = sentItem(ack_packet.acknum);
+    acked.resent = false;
+    sampleRtt(acked.ackedat - acked.firstsent);
+    rto = rto * 2 < MAX_TIMEOUT ? rto * 2 : MAX_TIMEOUT;
+  }else{
+    /* Duplicate ACK, window update or ACK outside of the packet window */
+  }
 
-          /* Make sure sequence number is not outside the window */
-          if(nextseqnum < base + N){
+  /* B's window reopened - stop probing */
+  if(persist_timer && A_window_open()){
+    stoptimer(0);
+    persist_timer = false;
+  }
 
-          /* Pop Front of buffer */
-          struct pkt pkt = A_pkt_buffer.front();
-          A_pkt_buffer.pop();
+  /* Send buffered packets while the window allows */
+  burst.clear();
+  while(A_window_open() && A_pkt_buffer.size() > 0){
 
-          /* Set Packet Values */
-          pkt.seqnum = nextseqnum;
-          pkt.acknum = -1;
-          pkt.checksum = compute_checksum(pkt);
-          
-          /* Add packet to packets sent */
-          windowItem w;
-          w.p = pkt;
-          w.timesent = get_sim_time();
-          pkts_sent[nextseqnum] = w;
+    /* Pop Front of buffer */
+    struct pkt pkt = A_pkt_buffer.front();
+    A_pkt_buffer.pop();
 
-          /* Start timer if first packet sent in window */
-          if(pkt.seqnum == base){
-            starttimer(0,TIMEOUT);
-            updateTimerStartTime(get_sim_time(),w);
+    /* Set Packet Values */
+    pkt.seqnum = nextseqnum;
+    pkt.acknum = -1;
+    pkt.checksum = compute_checksum(pkt);
+    
+    /* Add packet to packets sent */
+    windowItem w;
+    w.p = pkt;
+    w.timesent = get_sim_time();
+    w.firstsent = w.timesent;
+    w.resent = false;
+    recordSend(w);
 
-            /* Reset Number of Packets sent last window */
+    /* Start timer if nothing else is outstanding */
+    if(pkts_unacked == 0){
+      starttimer(0,rto);
+      updateTimerStartTime(get_sim_time(),w);
+    }
 
-          }
+    burst.push_back(pkt);
+    fecAdd(pkt);
+    pkts_unacked++;
 
-          /* Send to layer 3 */
-          tolayer3(0,pkt);
-          pkts_unacked++;
+    /* Increment next seq num */
+    nextseqnum++;
+  }
 
-          /* Increment next seq num */
+  /* Send to layer 3 as one burst */
+  tolayer3_batch(0,burst.data(),burst.size());
+  layer5_backpressure(0,A_pkt_buffer.full());
 
-          nextseqnum++;
-          }
-        i++;
-        }
-      } 
-    }
-  }else{
-    /* Ack falls outside of the packet window */
-  }
+  startPersist();
 }
 
 /*
@@ -262,139 +530,400 @@ TIME  Event
 
 
 */
-void A_timerinterrupt(){
-
-  float interrupt_time = get_sim_time();
+template <int W>
+void sender<W>::timerinterrupt(){
+
+  if(persist_timer){
+    /* Window probe - resend the last acked packet so B re-advertises its window */
+    tolayer3(0,sentItem(nextseqnum - 1).p);
+    starttimer(0,TIMEOUT);
+    return;
+  }
 
   struct windowItem inter_pkt = getTimerStartWindowItem();
-  
 
   /* Resend Packet */
   inter_pkt.timesent = get_sim_time();
+  inter_pkt.resent = true;
 
   /* send to layer 3*/
   tolayer3(0,inter_pkt.p);
 
-  /* Save Interrupting packet time time */
-  float last_sent_time = inter_pkt.timesent;
-
   /* Update Packet in pkts_sent */
-  pkts_sent[inter_pkt.p.seqnum] = inter_pkt; 
+  recordSend(inter_pkt);
 
-  /* Get time sent of next unacked packet this could be the one just re-sent or another */
-  int last_sent_seqnum = inter_pkt.p.seqnum;
+  /* Start timer for the next unacked packet, this could be the one just re-sent or another */
+  restartTimer();
+}  
 
-  /* Set next_packet_sent_time to packet just resent */
-  float next_packet_sent_time = inter_pkt.timesent;
+/* the following routine will be called once (only) before any other */
+/* entity A routines are called. You can use it to do any initialization */
+template <int W>
+void sender<W>::init()
+{
+  base = 0;                 /* Start base at 1 */
+  nextseqnum = 0;           /* Start nextseqnum at 1 */
+  N = getwinsize();         /* Set Window Size */
+  snd_acked.init(N);
+  pkts_sent.init(snd_acked.capacity());
+  pkts_unacked = 0;
+  TIMEOUT = gettimeout(DEFAULT_TIMEOUT, N);
+  MAX_TIMEOUT = 16 * TIMEOUT;
+  rto = TIMEOUT;
+  srtt = -1;
+  rttvar = 0;
+  peer_rcv_base = 0;
+  peer_rwnd = getrcvbufsize();
+  persist_timer = false;
+  A_pkt_buffer.init(getsndbufsize());
+  fec_k = getfecdata();
+  fec_p = getfecparity();
+  if(fec_k > FEC_MAX_DATA || (fec_k > 0 && (fec_p < 1 || fec_p > fec_k || fec_p > FEC_MAX_PARITY))){
+    fprintf(stderr,"FEC blocks take 1 to %d data packets and 1 to %d parity packets, no more than data\n",
+            FEC_MAX_DATA,FEC_MAX_PARITY);
+    exit(-1);
+  }
+  fec_parity.assign(fec_k > 0 ? fec_p : 0,pkt());
+  burst.reserve(fec_k > 0 ? N + N / fec_k * fec_p + fec_p : N);
+}
 
+/* Free space in B's buffer, packets waiting for layer5 hold their slot */
+template <int W>
+int receiver<W>::B_rwnd(){
+  int rwnd = B_bufsize - (int)B_deliver_buffer.size();
+  return rwnd > 0 ? rwnd : 0;
+}
 
-  /* Check if any packets are unacked after this that should set timer instead */
-  struct windowItem start_timer_window_pkt = inter_pkt;
+/* Send ACK to A advertising B's current window */
+template <int W>
+void receiver<W>::B_send_ack(int acknum){
+  struct pkt p;
+  p.seqnum = 0;
+  p.acknum = acknum;
+  setWindowAdvert(&p,rcv_base,B_rwnd());
+  p.checksum = compute_checksum(p);
+  tolayer3(1,p);
+}
 
-  for(int i = base; i <= base + pkts_unacked; i++){
-    struct windowItem w = pkts_sent[i]; 
-    if(w.p.acknum == -1 && w.p.seqnum != inter_pkt.p.seqnum){
-      start_timer_window_pkt = w;
-      next_packet_sent_time = w.timesent;
+/* NAK every packet from rcv_base up to upto-1 that has not arrived and */
+/* was not NAKed before; a NAK or retransmission that is lost is left   */
+/* to A's timeout                                                       */
+template <int W>
+void receiver<W>::B_send_naks(int upto){
+  if(!naks){
+    return;
+  }
+  for(int seq = rcv_base; seq < upto; seq++){
+    if(!rcv_window.test(seq) && !rcv_naked.test(seq)){
+      struct pkt p;
+      p.seqnum = NAK;
+      p.acknum = seq;
+      setWindowAdvert(&p,rcv_base,B_rwnd());
+      p.checksum = compute_checksum(p);
+      rcv_naked.set(seq);
+      tolayer3(1,p);
+    }
+  }
+}
 
-      /* Exit for loop this should grab the first one unacked after the packet */
-      break;
+/* B's record of a block, or NULL if the block is older than those kept */
+template <int W>
+struct fecBlock *receiver<W>::fecFind(int block){
+  struct fecBlock &f = fec_blocks[block % fec_blocks.size()];
+  if(f.block > block){
+    return NULL;
+  }
+  if(f.block < block){
+    memset(&f,0,sizeof(f));
+    f.block = block;
+  }
+  return &f;
+}
+
+/* Rebuild the data packet a group is missing, if its parity is in and */
+/* it is missing just one, and take it as if it had arrived           */
+template <int W>
+void receiver<W>::fecRecover(struct fecBlock *f,int group){
+  int missing = -1, count = 0;
+
+  if(!((f->have_parity >> group) & 1)){
+    return;
+  }
+  for(int i = group; i < fec_k; i += fec_p){
+    if(!((f->received >> i) & 1)){
+      missing = i;
+      count++;
     }
+  }
+  if(count != 1){
+    return;
+  }
 
+  struct pkt p;
+  p.seqnum = f->block * fec_k + missing;
+  p.acknum = -1;
+  for(int b = 0; b < sizeof(p.payload); b++){
+    p.payload[b] = f->parity[group][b] ^ f->data_xor[group][b];
   }
+  p.checksum = compute_checksum(p);
+  input(p);
+}
 
-  /* Calculate timer for next packet which is the next unacked packet */
-  float diff = last_sent_time - next_packet_sent_time;
-  float t = TIMEOUT - diff;
-  updateTimerStartTime(t,start_timer_window_pkt);
-  starttimer(0,t);
-}  
+/* Note a data packet for FEC, the first time it arrives */
+template <int W>
+void receiver<W>::fecData(struct pkt p){
+  if(fec_k == 0){
+    return;
+  }
+  struct fecBlock *f = fecFind(p.seqnum / fec_k);
+  int i = p.seqnum % fec_k;
+  if(f == NULL || ((f->received >> i) & 1)){
+    return;
+  }
+  f->received |= (uint64_t)1 << i;
+  for(int b = 0; b < sizeof(p.payload); b++){
+    f->data_xor[i % fec_p][b] ^= p.payload[b];
+  }
+  fecRecover(f,i % fec_p);
+}
 
-/* the following routine will be called once (only) before any other */
-/* entity A routines are called. You can use it to do any initialization */
-void A_init()
-{
-  base = 0;                 /* Start base at 1 */
-  nextseqnum = 0;           /* Start nextseqnum at 1 */
-  N = getwinsize();         /* Set Window Size */
+/* A parity packet arrived. The channel keeps order, so the block's data */
+/* is all in or lost by now; after the last parity, NAK what FEC could   */
+/* not rebuild.                                                          */
+template <int W>
+void receiver<W>::fecParity(struct pkt p){
+  int block = p.acknum / fec_k, group = p.acknum % fec_k;
+  struct fecBlock *f = fecFind(block);
+  if(f == NULL || group >= fec_p || ((f->have_parity >> group) & 1)){
+    return;
+  }
+  f->have_parity |= 1 << group;
+  memcpy(f->parity[group],p.payload,sizeof(p.payload));
+  fecRecover(f,group);
+  if(group == fec_p - 1){
+    B_send_naks(block * fec_k + fec_k);
+  }
+}
+
+/* Hand a run of in order messages to layer5, or queue them for a slow consumer */
+template <int W>
+void receiver<W>::B_deliver(struct msg *msgs,int count){
+  if(B_drain_rate <= 0){
+    tolayer5_batch(1,msgs,count);
+    return;
+  }
+
+  for(int i = 0; i < count; i++){
+    B_deliver_buffer.push(msgs[i]);
+  }
+  if(!B_timer_running){
+    starttimer(1,1 / B_drain_rate);
+    B_timer_running = true;
+  }
 }
 
 /* Note that with simplex transfer from a-to-B, there is no B_output() */
 /* called from layer 3, when a packet arrives for layer 4 at B*/
-void B_input(struct pkt recvd_packet)
+template <int W>
+void receiver<W>::input(struct pkt recvd_packet)
 {
 
   int checksum = 0;
   checksum = compute_checksum(recvd_packet);
 
-  if(checksum == recvd_packet.checksum){
+  if(checksum == recvd_packet.checksum && recvd_packet.seqnum == PARITY){
+    if(fec_k > 0 && recvd_packet.acknum >= 0){
+      fecParity(recvd_packet);
+    }
+  }else if(checksum == recvd_packet.checksum){
 
-    /* Check if packet is between rcv_base and rcv_base + N */
-    if(recvd_packet.seqnum >= rcv_base && recvd_packet.seqnum <= rcv_base + N - 1){
+    /* Check if packet is between rcv_base and rcv_base + N and fits in the buffer */
+    if(recvd_packet.seqnum >= rcv_base && recvd_packet.seqnum <= rcv_base + N - 1 &&
+       recvd_packet.seqnum < rcv_base + B_rwnd()){
 
-      /* Send ACK Packet to A*/
-      struct pkt p;
-      p.acknum = recvd_packet.seqnum;
-      p.checksum = compute_checksum(p);
-      tolayer3(1,p);
+      /* Buffer Packet, a duplicate keeps the copy already buffered */
+      if(!rcv_window.test(recvd_packet.seqnum)){
+        memcpy(rcv_slots[rcv_window.slot(recvd_packet.seqnum)].data,recvd_packet.payload,sizeof(recvd_packet.payload));
+        rcv_window.set(recvd_packet.seqnum);
+      }
 
       if(recvd_packet.seqnum == rcv_base){
 
-        /* Add to pkts recvd and mark as delivered */
-        struct windowItem w;
-        w.p = recvd_packet;
-        w.delivered = 1;
-        pkts_recvd[recvd_packet.seqnum] = w;
-
-        /* Deliver to layer5 */
-        tolayer5(1,w.p.payload);
-
-        /* Deliver any buffered consecutive packets to layer5*/
-        int diff = 1;
-        int num_delivered = 1;
-
-        for(int i = rcv_base; i < rcv_base + N; i++){
-          struct windowItem w1 = pkts_recvd[i];
-          struct windowItem w2 = pkts_recvd[i + 1];
-
-          if(w2.p.seqnum - w1.p.seqnum == diff){
-
-            /* Consecutive Packet - Deliver to layer 5 */
-            tolayer5(1,w2.p.payload);
-            pkts_recvd[i+1].delivered = 1;
-            num_delivered++;
-          }else{
-            /* Found a non consecutive packet - exit loop */
-            break;
-          }
+        /* Deliver the run of consecutive buffered packets starting at rcv_base */
+        int run = rcv_window.run_length(rcv_base,N);
+        int first = rcv_window.slot(rcv_base);
+        int head = run;
+        if(first + run > rcv_window.capacity()){
+          /* Run wraps around the end of the slots */
+          head = rcv_window.capacity() - first;
+        }
+        B_deliver(&rcv_slots[first],head);
+        if(head < run){
+          B_deliver(&rcv_slots[0],run - head);
         }
 
         /* Increment rcv_base by number of packets delivered */
-        rcv_base = rcv_base + num_delivered;
-      }else{
-
-        /* Buffer Packet */
-        struct windowItem w;
-        w.p = recvd_packet;
-        w.delivered = 0;
-        pkts_recvd[w.p.seqnum] = w;
+        rcv_window.clear_run(rcv_base,run);
+        rcv_naked.clear_run(rcv_base,run);
+        rcv_base = rcv_base + run;
+      }
+
+      /* Send ACK Packet to A*/
+      B_send_ack(recvd_packet.seqnum);
+
+      /* Packets before this one that are still missing were lost; with */
+      /* FEC they are NAKed once the block's parity could not rebuild them */
+      if(fec_k == 0){
+        B_send_naks(recvd_packet.seqnum);
       }
     }else if(recvd_packet.seqnum >= rcv_base - N && recvd_packet.seqnum <= rcv_base - 1){
       
       /* Send ACK for packet receieved - no need to buffer since it has already been recvd */
-      struct pkt p;
-      p.acknum = recvd_packet.seqnum; 
-      p.checksum = compute_checksum(p);
-      tolayer3(1,p); 
+      B_send_ack(recvd_packet.seqnum);
+    }else{
+      /* No room in B's buffer - drop and re-advertise the window */
+      B_send_ack(rcv_base - 1);
     }
+    fecData(recvd_packet);
   }else{
-    /* Packet Corrupt - Let Timeout */
+    /* Packet Corrupt - Let Timeout, or NAK the oldest missing packet */
+    B_send_naks(rcv_base + 1);
   }
 }
 
 /* the following rouytine will be called once (only) before any other */
 /* entity B routines are called. You can use it to do any initialization */
-void B_init()
+template <int W>
+void receiver<W>::init()
 {
+  N = getwinsize();
   rcv_base = 0;
+  rcv_window.init(getwinsize());
+  rcv_slots.init(rcv_window.capacity());
+  B_bufsize = getrcvbufsize();
+  B_drain_rate = getdrainrate();
+  B_timer_running = false;
+  naks = getnaks();
+  rcv_naked.init(getwinsize());
+  fec_k = getfecdata();
+  fec_p = getfecparity();
+  if(fec_k > 0){
+    /* Blocks from a window behind rcv_base to a window ahead of it */
+    struct fecBlock unused;
+    memset(&unused,0,sizeof(unused));
+    unused.block = -1;
+    fec_blocks.assign(2 * N / fec_k + 4,unused);
+  }
+}
+
+/* save or restore one flow's state, see checkpoint.h */
+template <int W>
+void sender<W>::checkpoint()
+{
+  A_pkt_buffer.checkpoint();
+  ckpt_value(N);
+  ckpt_value(base);
+  ckpt_value(nextseqnum);
+  pkts_sent.checkpoint();
+  snd_acked.checkpoint();
+  ckpt_deque(send_times);
+  ckpt_value(timer_start_pkt);
+  ckpt_value(pkts_unacked);
+  ckpt_value(rto);
+  ckpt_value(srtt);
+  ckpt_value(rttvar);
+  ckpt_value(peer_rcv_base);
+  ckpt_value(peer_rwnd);
+  ckpt_value(persist_timer);
+  ckpt_vector(fec_parity);
+}
+
+template <int W>
+void receiver<W>::checkpoint()
+{
+  ckpt_value(rcv_base);
+  rcv_window.checkpoint();
+  rcv_slots.checkpoint();
+  ckpt_queue(B_deliver_buffer);
+  ckpt_value(B_timer_running);
+  rcv_naked.checkpoint();
+  ckpt_vector(fec_blocks);
+}
+
+/* called when B's timer goes off - the application consumes one packet */
+template <int W>
+void receiver<W>::timerinterrupt()
+{
+  bool was_closed = (B_rwnd() == 0);
+
+  struct msg m = B_deliver_buffer.front();
+  B_deliver_buffer.pop();
+  tolayer5(1,m.data);
+
+  if(B_deliver_buffer.size() > 0){
+    starttimer(1,1 / B_drain_rate);
+  }else{
+    B_timer_running = false;
+  }
+
+  /* Window reopened - let A know right away */
+  if(was_closed){
+    B_send_ack(rcv_base - 1);
+  }
+}
+
+/* Simulator entry points, each runs the current flow's A or B */
+void A_output(struct msg message)
+{
+  with_senders([&](auto &flows){ flows[getflow()].output(message); });
+}
+
+void A_input(struct pkt packet)
+{
+  with_senders([&](auto &flows){ flows[getflow()].input(packet); });
+}
+
+void A_timerinterrupt()
+{
+  with_senders([&](auto &flows){ flows[getflow()].timerinterrupt(); });
+}
+
+void A_init()
+{
+  with_senders([&](auto &flows){
+    flows.resize(getnflows());
+    for(int i = 0; i < getnflows(); i++){
+      flows[i].init();
+    }
+  });
+}
+
+void B_input(struct pkt packet)
+{
+  with_receivers([&](auto &flows){ flows[getflow()].input(packet); });
+}
+
+void B_timerinterrupt()
+{
+  with_receivers([&](auto &flows){ flows[getflow()].timerinterrupt(); });
+}
+
+void B_init()
+{
+  with_receivers([&](auto &flows){
+    flows.resize(getnflows());
+    for(int i = 0; i < getnflows(); i++){
+      flows[i].init();
+    }
+  });
+}
+
+/* save or restore A and B state of every flow, see checkpoint.h */
+void protocol_checkpoint()
+{
+  ckpt_tag("SR");
+  for(int i = 0; i < getnflows(); i++){
+    with_senders([&](auto &flows){ flows[i].checkpoint(); });
+    with_receivers([&](auto &flows){ flows[i].checkpoint(); });
+  }
 }
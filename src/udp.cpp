@@ -0,0 +1,634 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <ctype.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "../include/frontend.h"
+#include "../include/wire.h"
+
+/*****************************************************************
+ UDP loopback backend. Runs the same protocol code as the simulator,
+ but A and B are two UDP sockets on 127.0.0.1 and time is wall-clock
+ time, so the protocols' real packet rates and CPU cost per packet can
+ be measured on one Linux box.
+  - tolayer3() queues the packet and the queue goes out with one
+    sendmmsg() call per epoll round (or when BATCH packets are queued);
+    each socket is read with recvmmsg(), BATCH datagrams at a time
+  - every timer and every flow's layer5 arrivals are timerfds, all
+    waited on by one epoll loop
+  - loss and corruption are applied before a packet is sent, with the
+    same probabilities and the same kinds of corruption as the simulator
+  - each datagram is one packet and its flow in the -W encoding
+ A time unit is -u microseconds of wall-clock time.
+******************************************************************/
+
+#define  A    0
+#define  B    1
+
+#define  BATCH          64     /* datagrams per sendmmsg/recvmmsg call */
+#define  MAXEVENTS      64     /* epoll events handled per round */
+#define  SOCKBUF  (4 << 20)    /* socket buffer size in bytes */
+
+/* epoll tags: the two sockets, then three timerfds per flow */
+#define  TAG_SOCKET      0     /* + A or B */
+#define  TAG_FLOW        2     /* + 3*flow + TIMER_A, TIMER_B or ARRIVAL */
+#define  TIMER_A         0
+#define  TIMER_B         1
+#define  ARRIVAL         2
+
+/* one side's socket and the packets waiting to be sent from it */
+struct endpoint {
+  int fd;
+  unsigned char out[BATCH][WIRE_MAX];   /* encoded, see wire.h */
+  int outlen[BATCH];
+  int nout;
+};
+
+struct udp_flow {
+  int timerfd[3];           /* A's timer, B's timer, layer5 arrivals */
+  int timer_running[2];
+  int A_application, A_transport, B_application, B_transport;
+  int nsim;                 /* messages from layer5 so far */
+  char *accepted;           /* letter of every message A accepted, in order */
+  int naccepted, accepted_cap;
+  struct backpressure bp;   /* A's buffer as layer5 sees it */
+  int ndropped_l5;          /* messages dropped by back-pressure */
+};
+
+struct endpoint ends[2];
+struct udp_flow *flows;
+int cur_flow = 0;           /* flow whose event is being handled */
+int epfd;
+
+int wire_format = WIRE_RAW;  /* packet encoding on the wire, see wire.h */
+int wire_report = 0;       /* -W given: report bytes on the wire */
+long long wire_bytes[2];   /* bytes A and B sent */
+float drain_deadline = 1000;  /* give up after this long without a delivery */
+int nblocked = 0;          /* flows with an arrival held back by -p block */
+double unit_usec = 1000;   /* length of a time unit in microseconds */
+
+int nsim = 0;              /* number of messages from 5 to 4 so far */
+
+/* Statistics */
+int A_application = 0;
+int A_transport = 0;
+int B_application = 0;
+int B_transport = 0;
+int ntolayer3 = 0;         /* number sent into layer 3 */
+int nlost = 0;             /* number lost by the shim */
+int ncorrupt = 0;          /* number corrupted by the shim */
+long ndatagrams_out = 0, ndatagrams_in = 0;
+long nsendmmsg = 0, nrecvmmsg = 0;
+long nsock_dropped = 0;    /* sendmmsg could not take them */
+double last_msg_time = 0;  /* time the last message left layer5 at A */
+double last_delivery = 0;  /* time of the latest delivery at B */
+struct timespec start_time;
+
+float jimsrand()
+{
+  double mmm = 2147483647;
+  return rand()/mmm;
+}
+
+/* wall-clock time since the start of the run, in time units */
+double now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((ts.tv_sec - start_time.tv_sec)*1e6 + (ts.tv_nsec - start_time.tv_nsec)/1e3) / unit_usec;
+}
+
+/* arm fd to go off once, units time units from now */
+void arm(int fd, double units)
+{
+  struct itimerspec its;
+  long long ns = llround(units * unit_usec * 1e3);
+
+  memset(&its, 0, sizeof(its));
+  if (ns < 1)
+     ns = 1;                   /* an all zero value would disarm it */
+  its.it_value.tv_sec = ns / 1000000000;
+  its.it_value.tv_nsec = ns % 1000000000;
+  timerfd_settime(fd, 0, &its, NULL);
+}
+
+void disarm(int fd)
+{
+  struct itimerspec its;
+
+  memset(&its, 0, sizeof(its));
+  timerfd_settime(fd, 0, &its, NULL);
+}
+
+/* 1 if fd really went off; a timer stopped after epoll saw it has not */
+int expired(int fd)
+{
+  unsigned long long n;
+
+  return read(fd, &n, sizeof(n)) == sizeof(n);
+}
+
+void watch(int fd, unsigned int tag)
+{
+  struct epoll_event ev;
+
+  ev.events = EPOLLIN;
+  ev.data.u32 = tag;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+     perror("epoll_ctl");
+     exit(-1);
+     }
+}
+
+/************************** SOCKETS ***************/
+
+void open_sockets()
+{
+  struct sockaddr_in addr[2];
+  socklen_t len;
+  int i, size = SOCKBUF;
+
+  for (i=0; i<2; i++) {
+     if ((ends[i].fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0)) < 0) {
+        perror("socket");
+        exit(-1);
+        }
+     setsockopt(ends[i].fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+     setsockopt(ends[i].fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+     memset(&addr[i], 0, sizeof(addr[i]));
+     addr[i].sin_family = AF_INET;
+     addr[i].sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+     addr[i].sin_port = 0;
+     len = sizeof(addr[i]);
+     if (bind(ends[i].fd, (struct sockaddr *)&addr[i], len) < 0
+         || getsockname(ends[i].fd, (struct sockaddr *)&addr[i], &len) < 0) {
+        perror("bind");
+        exit(-1);
+        }
+     ends[i].nout = 0;
+     }
+  for (i=0; i<2; i++) {
+     if (connect(ends[i].fd, (struct sockaddr *)&addr[1-i], sizeof(addr[1-i])) < 0) {
+        perror("connect");
+        exit(-1);
+        }
+     watch(ends[i].fd, TAG_SOCKET + i);
+     }
+}
+
+/* send everything queued at one side with as few sendmmsg calls as it takes */
+void flush(int AorB)
+{
+  struct endpoint *e = &ends[AorB];
+  struct mmsghdr msgs[BATCH];
+  struct iovec iov[BATCH];
+  int i, sent, done;
+
+  memset(msgs, 0, e->nout * sizeof(struct mmsghdr));
+  for (i=0; i<e->nout; i++) {
+     iov[i].iov_base = e->out[i];
+     iov[i].iov_len = e->outlen[i];
+     msgs[i].msg_hdr.msg_iov = &iov[i];
+     msgs[i].msg_hdr.msg_iovlen = 1;
+     }
+  for (done = 0; done < e->nout; done += sent) {
+     sent = sendmmsg(e->fd, msgs + done, e->nout - done, 0);
+     nsendmmsg++;
+     if (sent <= 0) {
+        if (sent < 0 && errno == EINTR) {
+           sent = 0;
+           continue;
+           }
+        /* socket buffer full: the rest is lost, as on a congested link */
+        nsock_dropped += e->nout - done;
+        break;
+        }
+     ndatagrams_out += sent;
+     }
+  e->nout = 0;
+}
+
+/* hand everything waiting at one side's socket to its protocol entity */
+void receive(int AorB)
+{
+  struct endpoint *e = &ends[AorB];
+  unsigned char in[BATCH][WIRE_MAX];
+  struct pkt packet;
+  int flow;
+  struct mmsghdr msgs[BATCH];
+  struct iovec iov[BATCH];
+  struct udp_flow *f;
+  int i, n;
+
+  do {
+     memset(msgs, 0, sizeof(msgs));
+     for (i=0; i<BATCH; i++) {
+        iov[i].iov_base = in[i];
+        iov[i].iov_len = WIRE_MAX;
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+     n = recvmmsg(e->fd, msgs, BATCH, MSG_DONTWAIT, NULL);
+     if (n <= 0)
+        break;
+     nrecvmmsg++;
+     ndatagrams_in += n;
+     for (i=0; i<n; i++) {
+        if (!wire_decode(wire_format, in[i], msgs[i].msg_len, &flow, &packet)
+            || flow < 0 || flow >= nflows)
+           continue;              /* not ours */
+        cur_flow = flow;
+        f = &flows[cur_flow];
+        if (TRACE>=2)
+           printf("\nEVENT time: %f, fromlayer3 entity: %d flow: %d\n", now(), AorB, cur_flow);
+        if (AorB == A)
+           A_input(packet);
+         else {
+           B_transport += 1;
+           f->B_transport += 1;
+           B_input(packet);
+         }
+        }
+  } while (n == BATCH);
+}
+
+/************************** LAYER5 ARRIVALS ***************/
+
+void generate_next_arrival(int flow)
+{
+  arm(flows[flow].timerfd[ARRIVAL], lambda*jimsrand()*2);   /* uniform on [0,2*lambda] */
+}
+
+void layer5_arrival(int flow)
+{
+  struct udp_flow *f = &flows[flow];
+  struct msg msg2give;
+  int i;
+
+  cur_flow = flow;
+  if (nsim >= nsimmax)
+     return;
+  if (f->bp.A_full && bp_policy != BP_DROP) {
+     /* A's buffer is full - hold layer5 back */
+     if (bp_policy == BP_BLOCK) {
+        f->bp.arrival_blocked = 1;   /* layer5_backpressure() resumes arrivals */
+        nblocked++;
+        }
+      else
+        arm(f->timerfd[ARRIVAL], lambda);
+     if (TRACE>0)
+        printf("          MAINLOOP: sender buffer full, arrival held back\n");
+     return;
+     }
+  generate_next_arrival(flow);
+  for (i=0; i<20; i++)
+     msg2give.data[i] = 97 + f->nsim % 26;
+  f->nsim++;
+  nsim++;
+  last_msg_time = now();
+  if (TRACE>=2)
+     printf("\nEVENT time: %f, fromlayer5 entity: 0 flow: %d\n", last_msg_time, flow);
+  if (f->bp.A_full) {
+     /* BP_DROP: A's buffer is full, message is lost at the sender */
+     f->ndropped_l5 += 1;
+     if (TRACE>0)
+        printf("          MAINLOOP: sender buffer full, message dropped\n");
+     return;
+     }
+  A_application += 1;
+  f->A_application += 1;
+  if (f->naccepted == f->accepted_cap) {
+     f->accepted_cap = f->accepted_cap > 0 ? f->accepted_cap*2 : 1024;
+     f->accepted = (char *)realloc(f->accepted, f->accepted_cap);
+     }
+  f->accepted[f->naccepted++] = msg2give.data[0];
+  A_output(msg2give);
+}
+
+void timer_expired(int flow, int AorB)
+{
+  cur_flow = flow;
+  flows[flow].timer_running[AorB] = 0;
+  if (TRACE>=2)
+     printf("\nEVENT time: %f, timerinterrupt entity: %d flow: %d\n", now(), AorB, flow);
+  if (AorB == A)
+     A_timerinterrupt();
+   else
+     B_timerinterrupt();
+}
+
+/************************** MAIN LOOP ***************/
+
+/* the UDP backend's own options, after the common ones in display_usage() */
+const char usage_more[] =
+    " -D Give up once nothing has been delivered for this many time units after the last message\n"
+    " -u Length of a time unit in microseconds\n"
+    " -W Wire encoding of packets, raw, compact or compact16, and report bytes on the wire\n";
+
+int main(int argc, char **argv)
+{
+   struct epoll_event events[MAXEVENTS];
+   struct rusage ru;
+   struct udp_flow *f;
+   double wall, cpu, timeout, stall_total;
+   unsigned int tag;
+   int i, n, opt, flow, dropped_total;
+   char seen[128];
+   long npackets;
+
+   memset(seen, 0, sizeof(seen));
+
+    while((opt = getopt(argc, argv, COMMON_OPTIONS "D:u:W:")) != -1){
+        seen[(unsigned char)opt] = 1;
+        if (read_common_option(opt))
+            continue;
+        switch (opt){
+            case 'D':     if((drain_deadline = atof(optarg)) <= 0.0){
+                            fprintf(stderr, "Invalid value for -%c\n", opt);
+                            exit(-1);
+                        }
+                        break;
+            case 'W':     if((wire_format = wire_format_parse(optarg)) < 0){
+                            fprintf(stderr, "Invalid value for -%c\n", opt);
+                            exit(-1);
+                        }
+                        wire_report = 1;
+                        break;
+            case 'u':     if((unit_usec = atof(optarg)) <= 0.0){
+                            fprintf(stderr, "Invalid value for -%c\n", opt);
+                            exit(-1);
+                        }
+                        break;
+            case '?':
+               default:    fprintf(stderr, "Invalid arguments!\n");
+                        display_usage(argv[0], usage_more);
+                        return -1;
+       }
+    }
+
+   if (missing_args(seen, "swmlctv")) {
+        fprintf(stderr, "Missing arguments!\n");
+        display_usage(argv[0], usage_more);
+        return -1;
+   }
+
+   srand(seed);
+   if ((epfd = epoll_create1(0)) < 0) {
+      perror("epoll_create1");
+      return -1;
+      }
+   open_sockets();
+   flows = (struct udp_flow *)calloc(nflows, sizeof(struct udp_flow));
+   for (flow=0; flow<nflows; flow++)
+      for (i=0; i<3; i++) {
+         if ((flows[flow].timerfd[i] = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) < 0) {
+            perror("timerfd_create");
+            return -1;
+            }
+         watch(flows[flow].timerfd[i], TAG_FLOW + 3*flow + i);
+         }
+
+   clock_gettime(CLOCK_MONOTONIC, &start_time);
+   A_init();
+   B_init();
+   for (flow=0; flow<nflows; flow++)
+      generate_next_arrival(flow);
+
+   while (1) {
+      /* done once every accepted message is delivered, or nothing has */
+      /* been delivered for -D time units since the last message, also */
+      /* while -p block holds layer5 back                              */
+      if (nsim >= nsimmax || nblocked > 0) {
+         if (nsim >= nsimmax && B_application == A_application)
+            break;
+         timeout = (last_delivery > last_msg_time ? last_delivery : last_msg_time) + drain_deadline - now();
+         if (timeout <= 0)
+            break;
+         }
+      n = epoll_wait(epfd, events, MAXEVENTS, 100);
+      if (n < 0 && errno != EINTR) {
+         perror("epoll_wait");
+         return -1;
+         }
+      for (i=0; i<n; i++) {
+         tag = events[i].data.u32;
+         if (tag < TAG_FLOW)
+            receive(tag - TAG_SOCKET);
+          else {
+            flow = (tag - TAG_FLOW) / 3;
+            opt = (tag - TAG_FLOW) % 3;
+            if (!expired(flows[flow].timerfd[opt]))
+               continue;              /* stopped since epoll saw it */
+            if (opt == ARRIVAL)
+               layer5_arrival(flow);
+             else
+               timer_expired(flow, opt);
+          }
+         }
+      flush(A);
+      flush(B);
+      }
+
+   wall = now();
+   getrusage(RUSAGE_SELF, &ru);
+   cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec/1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec/1e6;
+   npackets = ndatagrams_out + ndatagrams_in;
+
+   printf(" Simulator terminated at time %f\n after sending %d msgs from layer5\n", wall, nsim);
+   printf("\n");
+   printf("[PA2]%d packets sent from the Application Layer of Sender A[/PA2]\n", A_application);
+   printf("[PA2]%d packets sent from the Transport Layer of Sender A[/PA2]\n", A_transport);
+   printf("[PA2]%d packets received at the Transport layer of Receiver B[/PA2]\n", B_transport);
+   printf("[PA2]%d packets received at the Application layer of Receiver B[/PA2]\n", B_application);
+   printf("[PA2]Total time: %f time units[/PA2]\n", wall);
+   printf("[PA2]Throughput: %f packets/time units[/PA2]\n", B_application/wall);
+   printf("[PA2]Wall clock: %f s, %f messages/s[/PA2]\n", wall*unit_usec/1e6, B_application/(wall*unit_usec/1e6));
+   printf("[PA2]%ld datagrams sent, %ld received, %ld lost at the socket, %f datagrams/s[/PA2]\n",
+          ndatagrams_out, ndatagrams_in, nsock_dropped, npackets/(wall*unit_usec/1e6));
+   printf("[PA2]CPU time: %f s, %f us per datagram[/PA2]\n", cpu, npackets > 0 ? cpu*1e6/npackets : 0);
+   printf("[PA2]%ld sendmmsg calls, %f datagrams per call; %ld recvmmsg calls, %f per call[/PA2]\n",
+          nsendmmsg, nsendmmsg > 0 ? (double)ndatagrams_out/nsendmmsg : 0,
+          nrecvmmsg, nrecvmmsg > 0 ? (double)ndatagrams_in/nrecvmmsg : 0);
+   if (wire_report) {
+      printf("[PA2]Bytes on the wire (%s): %lld from A, %lld from B, %f per datagram[/PA2]\n",
+             wire_format_name(wire_format), wire_bytes[A], wire_bytes[B],
+             ntolayer3 > nlost ? (double)(wire_bytes[A] + wire_bytes[B])/(ntolayer3 - nlost) : 0);
+      printf("[PA2]Byte goodput: %f payload bytes/time units, %f%% of the bytes on the wire are overhead[/PA2]\n",
+             B_application*20.0/wall,
+             wire_bytes[A] + wire_bytes[B] > 0 ? 100.0 - 100.0*B_application*20/(wire_bytes[A] + wire_bytes[B]) : 0);
+      }
+   stall_total = 0;
+   dropped_total = 0;
+   for (i=0; i<nflows; i++) {
+      stall_total += sender_stall(&flows[i].bp, wall);
+      dropped_total += flows[i].ndropped_l5;
+      }
+   printf("[PA2]%d messages dropped by sender back-pressure[/PA2]\n", dropped_total);
+   printf("[PA2]Sender stall time: %f time units[/PA2]\n", stall_total);
+   if (B_application != A_application)
+      printf("[PA2]%d messages still undelivered at the deadline[/PA2]\n", A_application - B_application);
+   if (nflows > 1)
+      for (i=0; i<nflows; i++) {
+         f = &flows[i];
+         printf("[PA2]Flow %d: %d sent, %d delivered, %d transport packets from A, %d at B, %f packets/time units[/PA2]\n",
+                i, f->A_application, f->B_application, f->A_transport, f->B_transport, f->B_application/wall);
+         }
+   return 0;
+}
+
+/********************** Student-callable ROUTINES ***********************/
+
+void stoptimer(int AorB)
+{
+ struct udp_flow *f = &flows[cur_flow];
+
+ if (TRACE>2)
+    printf("          STOP TIMER: stopping timer at %f\n", now());
+ if (f->timer_running[AorB]) {
+    disarm(f->timerfd[AorB]);
+    f->timer_running[AorB] = 0;
+    return;
+    }
+  printf("Warning: unable to cancel your timer. It wasn't running.\n");
+}
+
+void starttimer(int AorB,double increment)
+{
+ struct udp_flow *f = &flows[cur_flow];
+
+ if (TRACE>2)
+    printf("          START TIMER: starting timer at %f\n", now());
+ if (f->timer_running[AorB]) {
+    printf("Warning: attempt to start a timer that is already started\n");
+    return;
+    }
+ arm(f->timerfd[AorB], increment);
+ f->timer_running[AorB] = 1;
+}
+
+/* the shim: lose or corrupt the packet as the simulator's channel would, */
+/* then queue it for the next sendmmsg()                                  */
+void tolayer3(int AorB,struct pkt packet)
+{
+ struct endpoint *e = &ends[AorB];
+ float x;
+
+ ntolayer3++;
+ if (AorB == A) {
+    A_transport += 1;
+    flows[cur_flow].A_transport += 1;
+    }
+
+ if (jimsrand() < lossprob) {
+    nlost++;
+    if (TRACE>0)
+       printf("          TOLAYER3: packet being lost\n");
+    return;
+    }
+ if (jimsrand() < corruptprob) {
+    ncorrupt++;
+    if ((x = jimsrand()) < .75)
+       packet.payload[0] = 'Z';   /* corrupt payload */
+      else if (x < .875)
+       packet.seqnum = 999999;
+      else
+       packet.acknum = 999999;
+    if (TRACE>0)
+       printf("          TOLAYER3: packet being corrupted\n");
+    }
+
+ e->outlen[e->nout] = wire_encode(wire_format, cur_flow, &packet, e->out[e->nout]);
+ wire_bytes[AorB] += e->outlen[e->nout];
+ e->nout++;
+ if (e->nout == BATCH)
+    flush(AorB);
+}
+
+void tolayer3_batch(int AorB,struct pkt *packets,int count)
+{
+ int i;
+
+ for (i=0; i<count; i++)
+    tolayer3(AorB, packets[i]);
+}
+
+void tolayer5(int AorB,char *datasent)
+{
+  struct udp_flow *f = &flows[cur_flow];
+  char expected[20];
+  int i;
+
+  if (TRACE>2) {
+     printf("          TOLAYER5: data received: ");
+     for (i=0; i<20; i++)
+        printf("%c",datasent[i]);
+     printf("\n");
+   }
+
+  /* every message is 20 copies of the letter A accepted it with */
+  if (f->B_application < f->naccepted)
+     memset(expected, f->accepted[f->B_application], 20);
+  check_delivery(f->B_application < f->naccepted ? expected : NULL, datasent);
+
+  last_delivery = now();
+  if (AorB == 1) {
+     B_application += 1;
+     f->B_application += 1;
+     }
+}
+
+void tolayer5_batch(int AorB, struct msg *msgs, int count)
+{
+  int i;
+  for (i=0; i<count; i++)
+     tolayer5(AorB, msgs[i].data);
+}
+
+/* called by A when its send buffer fills up (full = 1) or has room again */
+void layer5_backpressure(int AorB, int full)
+{
+  struct udp_flow *f = &flows[cur_flow];
+
+  if (AorB == A && sender_backpressure(&f->bp, full, now())) {
+     nblocked--;
+     arm(f->timerfd[ARRIVAL], 0);
+     }
+}
+
+/* a real path has no -L to take its round trip from */
+double gettimeout(double dflt, int inflight)
+{
+    return dflt;
+}
+
+double get_sim_time()
+{
+    return now();
+}
+
+int getflow()
+{
+    return cur_flow;
+}
+
+/* checkpoints are a simulator feature; nothing is saved here */
+void checkpoint_io(void *data, int len)
+{
+}
+
+int checkpoint_saving()
+{
+    return 0;
+}
@@ -0,0 +1,160 @@
+#include "../include/wire.h"
+
+#include <string.h>
+
+/* ******************************************************************
+ Packet encodings for -W, see wire.h. Multi-byte fields are little
+ endian; varints are LEB128 of the zigzagged value, so small negative
+ seqnums such as a NAK's -1 stay one byte.
+**********************************************************************/
+
+#define WIRE_LEN_MASK  0x1f   /* header byte: payload length */
+#define WIRE_CSUM16    0x20   /* header byte: 16 bit checksum */
+
+int wire_format_parse(const char *name)
+{
+  if (strcmp(name, "raw") == 0)
+    return WIRE_RAW;
+  if (strcmp(name, "compact") == 0)
+    return WIRE_COMPACT;
+  if (strcmp(name, "compact16") == 0)
+    return WIRE_COMPACT16;
+  return -1;
+}
+
+const char *wire_format_name(int format)
+{
+  static const char *names[] = { "raw", "compact", "compact16" };
+  return names[format];
+}
+
+static int put_varint(unsigned char *buf, int v)
+{
+  unsigned int z = ((unsigned int)v << 1) ^ (unsigned int)(v >> 31);
+  int n = 0;
+
+  while (z >= 0x80) {
+    buf[n++] = (z & 0x7f) | 0x80;
+    z >>= 7;
+  }
+  buf[n++] = z;
+  return n;
+}
+
+/* returns the bytes read, or 0 if the varint runs past end */
+static int get_varint(const unsigned char *buf, const unsigned char *end, int *v)
+{
+  unsigned int z = 0;
+  int n = 0, shift = 0;
+
+  do {
+    if (buf + n >= end || shift > 28)
+      return 0;
+    z |= (unsigned int)(buf[n] & 0x7f) << shift;
+    shift += 7;
+  } while (buf[n++] & 0x80);
+  *v = (int)(z >> 1) ^ -(int)(z & 1);
+  return n;
+}
+
+static int varint_size(int v)
+{
+  unsigned int z = ((unsigned int)v << 1) ^ (unsigned int)(v >> 31);
+  int n = 1;
+
+  while (z >= 0x80) {
+    z >>= 7;
+    n++;
+  }
+  return n;
+}
+
+/* payload length once its trailing zeros are dropped */
+static int payload_len(const struct pkt *p)
+{
+  int len = sizeof(p->payload);
+
+  while (len > 0 && p->payload[len-1] == 0)
+    len--;
+  return len;
+}
+
+int wire_size(int format, int flow, const struct pkt *p)
+{
+  if (format == WIRE_RAW)
+    return sizeof(int) + sizeof(struct pkt);
+  return 1 + varint_size(flow) + varint_size(p->seqnum) + varint_size(p->acknum)
+         + (format == WIRE_COMPACT16 ? 2 : 4) + payload_len(p);
+}
+
+int wire_encode(int format, int flow, const struct pkt *p, unsigned char *buf)
+{
+  unsigned int csum = p->checksum;
+  int len, n, i;
+
+  if (format == WIRE_RAW) {
+    memcpy(buf, &flow, sizeof(int));
+    memcpy(buf + sizeof(int), p, sizeof(struct pkt));
+    return sizeof(int) + sizeof(struct pkt);
+  }
+
+  len = payload_len(p);
+  buf[0] = len | (format == WIRE_COMPACT16 ? WIRE_CSUM16 : 0);
+  n = 1;
+  n += put_varint(buf + n, flow);
+  n += put_varint(buf + n, p->seqnum);
+  n += put_varint(buf + n, p->acknum);
+  for (i = 0; i < (format == WIRE_COMPACT16 ? 2 : 4); i++)
+    buf[n++] = csum >> (8 * i);
+  memcpy(buf + n, p->payload, len);
+  return n + len;
+}
+
+int wire_decode(int format, const unsigned char *buf, int len, int *flow, struct pkt *p)
+{
+  const unsigned char *end = buf + len;
+  unsigned int csum = 0, sum;
+  int n, k, i, plen, csum_bytes;
+
+  if (format == WIRE_RAW) {
+    if (len != (int)(sizeof(int) + sizeof(struct pkt)))
+      return 0;
+    memcpy(flow, buf, sizeof(int));
+    memcpy(p, buf + sizeof(int), sizeof(struct pkt));
+    return 1;
+  }
+
+  if (len < 1)
+    return 0;
+  plen = buf[0] & WIRE_LEN_MASK;
+  csum_bytes = (buf[0] & WIRE_CSUM16) ? 2 : 4;
+  if (plen > (int)sizeof(p->payload))
+    return 0;
+  n = 1;
+  if ((k = get_varint(buf + n, end, flow)) == 0)
+    return 0;
+  n += k;
+  if ((k = get_varint(buf + n, end, &p->seqnum)) == 0)
+    return 0;
+  n += k;
+  if ((k = get_varint(buf + n, end, &p->acknum)) == 0)
+    return 0;
+  n += k;
+  if (n + csum_bytes + plen != len)
+    return 0;
+  for (i = 0; i < csum_bytes; i++)
+    csum |= (unsigned int)buf[n++] << (8 * i);
+  memset(p->payload, 0, sizeof(p->payload));
+  memcpy(p->payload, buf + n, plen);
+
+  if (csum_bytes == 4) {
+    p->checksum = (int)csum;
+    return 1;
+  }
+  /* the protocols' sum, moved by however far its low 16 bits are off */
+  sum = (unsigned int)p->seqnum + (unsigned int)p->acknum;
+  for (i = 0; i < (int)sizeof(p->payload); i++)
+    sum += p->payload[i];
+  p->checksum = (int)(sum + (short)(csum - sum));
+  return 1;
+}